@@ -0,0 +1,105 @@
+#pragma once
+
+// Per-phase controller for the current the charger is allowed to draw.
+//
+// The charger reads the phase currents we send it and keeps
+// "fuse limit - reported current" as its headroom, so the value controlled
+// here is exactly what the charger may take on each phase. The error is the
+// surplus on the phase: positive when the house delivers to the grid, negative
+// when it imports. A proportional-integral term drives it to zero.
+//
+// Anti-windup: whenever the output saturates (at 0, at the phase limit, or at
+// the weakest phase in three-phase mode) the integral is reset so that the
+// controller output equals the applied value, and it resumes from there as
+// soon as the error changes sign.
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+
+struct ControllerSettings {
+    double kp = 0.5;                // A of output per A of surplus
+    double ki = 0.25;               // A of output per A of surplus per second
+    double period = 1.0;            // Minimum seconds between two updates
+    std::array<double, 3> limits = {{0, 0, 0}};  // Highest output per phase; 0: the current limit
+    bool three_phases = false;      // The car draws the same current on every phase
+};
+
+// A phase limit of 0 or above the charger's current limit becomes the
+// current limit: the output can never exceed what may be reported
+inline void apply_current_limit(ControllerSettings& settings, double current_limit) {
+    for (double& limit : settings.limits) {
+        if (limit <= 0 || limit > current_limit) limit = current_limit;
+    }
+}
+
+struct PhaseMeasurement {
+    double current = 0;      // A, unsigned, as reported by the meter
+    double consumption = 0;  // kW taken from the grid
+    double generation = 0;   // kW delivered to the grid
+    double voltage = 0;      // V, 0 when the meter does not report it
+};
+
+class CurrentController {
+public:
+    explicit CurrentController(const ControllerSettings& settings = ControllerSettings()) : settings_(settings) {}
+
+    const ControllerSettings& settings() const {
+        return settings_;
+    }
+
+    // Signed surplus in A. The power figures have a resolution of 1 W where
+    // the meter rounds currents to whole amps, so they give the magnitude
+    // when the voltage is known.
+    static double surplus(const PhaseMeasurement& phase) {
+        double power = phase.generation - phase.consumption;
+        if (power == 0) return 0;
+        double magnitude = phase.voltage > 0 ? std::abs(power) * 1000 / phase.voltage : phase.current;
+        return power > 0 ? magnitude : -magnitude;
+    }
+
+    // Feeds one telegram, taken at `now` seconds on a monotonic clock.
+    // Returns false when less than one period has passed since the last update,
+    // less a tenth: a meter that sends once per period arrives a little early
+    // about half the time, and skipping those telegrams would halve the rate.
+    bool update(const std::array<PhaseMeasurement, 3>& phases, double now) {
+        double dt = settings_.period;
+        if (has_updated_) {
+            if (now - last_update_ < period_tolerance * settings_.period) return false;
+            // A gap in the telegrams must not turn into one huge integral step
+            dt = std::min(now - last_update_, 5 * settings_.period);
+        }
+        has_updated_ = true;
+        last_update_ = now;
+
+        std::array<double, 3> error;
+        std::array<double, 3> wanted;
+        for (size_t i = 0; i < 3; ++i) {
+            error[i] = surplus(phases[i]);
+            integral_[i] += settings_.ki * error[i] * dt;
+            wanted[i] = settings_.kp * error[i] + integral_[i];
+            output_[i] = std::max(0.0, std::min(wanted[i], settings_.limits[i]));
+        }
+        if (settings_.three_phases) {
+            double applied = std::min({output_[0], output_[1], output_[2]});
+            output_.fill(applied);
+        }
+        for (size_t i = 0; i < 3; ++i) {
+            if (wanted[i] != output_[i]) integral_[i] = output_[i] - settings_.kp * error[i];
+        }
+        return true;
+    }
+
+    const std::array<double, 3>& output() const {
+        return output_;
+    }
+
+private:
+    static constexpr double period_tolerance = 0.9;
+
+    ControllerSettings settings_;
+    std::array<double, 3> integral_ = {{0, 0, 0}};
+    std::array<double, 3> output_ = {{0, 0, 0}};
+    double last_update_ = 0;
+    bool has_updated_ = false;
+};
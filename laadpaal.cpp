@@ -1,16 +1,40 @@
 #include <array>
+#include <atomic>
 #include <boost/asio.hpp>
 #include <boost/bind/bind.hpp>
+#include <algorithm>
 #include <cctype>
+#include <charconv>
+#include <cmath>
+#include <chrono>
 #include <csignal>
+#include <cstdint>
 #include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <cstdio>
 #include <iostream>
-#include <regex>
-#include <sstream>
+#include <map>
 #include <iomanip>
+#include <sstream>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
 #include <vector>
 #include <fstream>
 #include <string>
+#include <string_view>
+
+#include "crc16.h"
+#include "current_controller.h"
+#include "obis_schema.h"
+#include "p1_capture.h"
+#include "p1_history.h"
+#include "p1_pipeline.h"
+#include "p1_snapshot.h"
+#include "realtime.h"
+#include "serial_tuning.h"
 
 
 using namespace std;
@@ -30,44 +54,644 @@ serial_port_base::stop_bits::type get_stop_bits(const string& stop_bits) {
     else throw invalid_argument("Invalid stop bits option");
 }
 
-class Crc16 {
+// Outgoing telegrams for the charger port: at most one on the wire and one
+// waiting, each in a buffer of its own that stays untouched until its write
+// completes. A telegram queued while another one is still waiting replaces
+// it, so the charger always gets the newest currents and a stalled port
+// never holds more than the two buffers.
+class OutboundQueue {
+public:
+    static const size_t capacity = TelegramFramer::capacity;
+    static_assert(TelegramEncoder::capacity <= capacity, "Rebuilt telegrams must fit");
+
+    struct Slot {
+        std::array<char, capacity> data;
+        size_t size = 0;
+        std::chrono::steady_clock::time_point queued_at;
+        std::chrono::steady_clock::time_point received_at;    // The meter telegram the data is based on
+        std::chrono::steady_clock::time_point first_byte_at;  // Read that brought its first byte
+
+        string_view view() const {
+            return string_view(data.data(), size);
+        }
+    };
+
+    // Copies the telegram into the free buffer. Returns false when that
+    // threw away a telegram that was still waiting.
+    bool push(string_view telegram, std::chrono::steady_clock::time_point received_at,
+              std::chrono::steady_clock::time_point first_byte_at) {
+        bool replaced = waiting_ >= 0;
+        int target = writing_ == 0 ? 1 : 0;
+        Slot& slot = slots_[target];
+        slot.size = telegram.size();
+        memcpy(slot.data.data(), telegram.data(), telegram.size());
+        slot.queued_at = std::chrono::steady_clock::now();
+        slot.received_at = received_at;
+        slot.first_byte_at = first_byte_at;
+        waiting_ = target;
+        return !replaced;
+    }
+
+    // The waiting telegram, now on the wire; nullptr while a write is in
+    // flight or nothing is waiting
+    const Slot* start() {
+        if (writing_ >= 0 || waiting_ < 0) return nullptr;
+        writing_ = waiting_;
+        waiting_ = -1;
+        return &slots_[writing_];
+    }
+
+    void finish() {
+        writing_ = -1;
+    }
+
+    const Slot* writing() const {
+        return writing_ >= 0 ? &slots_[writing_] : nullptr;
+    }
+
+    size_t depth() const {
+        return (writing_ >= 0) + (waiting_ >= 0);
+    }
+
 private:
-    static const unsigned short polynomial = 0xA001;
-    unsigned short table[256];
+    std::array<Slot, 2> slots_;
+    int writing_ = -1;
+    int waiting_ = -1;
+};
+
+enum class LogLevel { debug, info, warning, error };
 
+inline LogLevel parse_log_level(const string& level) {
+    if (level == "debug") return LogLevel::debug;
+    else if (level == "info") return LogLevel::info;
+    else if (level == "warning") return LogLevel::warning;
+    else if (level == "error") return LogLevel::error;
+    else throw invalid_argument("Invalid log level " + level);
+}
+
+// Structured logger that keeps terminal and syslog I/O off the io threads.
+// Producers format a record straight into a slot of a bounded multi-producer
+// ring (no locks, no allocation) and a background thread writes the records
+// out as JSON lines. When the ring is full the record is dropped and counted.
+//
+//     AsyncLogger::instance().log(LogLevel::error, "write_error", name_).field("message", ec.message());
+//
+// The record is published when the temporary returned by log() goes away.
+class AsyncLogger {
 public:
-    Crc16() {
-        unsigned short value;
-        unsigned short temp;
-
-        for (unsigned short i = 0; i < 256; ++i) {
-            value = 0;
-            temp = i;
-            for (unsigned char j = 0; j < 8; ++j) {
-                if (((value ^ temp) & 0x0001) != 0) {
-                    value = (value >> 1) ^ polynomial;
-                } else {
-                    value >>= 1;
+    static constexpr size_t slot_count = 256;
+    // Room for a status record with every field of the schema: a quoted
+    // name of at most 24 characters and a number of at most 24 each, plus
+    // the statistics. Dashboard frames that are larger span several slots.
+    static constexpr size_t record_capacity = 1024 + obis_field_count * 64;
+    static constexpr size_t max_screen_slots = slot_count / 8;
+
+    struct Slot {
+        atomic<size_t> sequence;
+        LogLevel level;
+        bool screen;     // Raw text for the dashboard instead of a JSON record
+        bool truncated;  // Fields were left out because they did not fit
+        const char* event;
+        std::chrono::system_clock::time_point time;
+        size_t length;
+        char text[record_capacity];
+    };
+
+    class Record {
+    public:
+        Record(AsyncLogger* logger, Slot* slot) : logger_(logger), slot_(slot) {}
+        Record(Record&& other) : logger_(other.logger_), slot_(other.slot_) { other.slot_ = nullptr; }
+        ~Record() {
+            if (slot_) logger_->publish(slot_);
+        }
+
+        Record& field(const char* key, string_view value) {
+            if (!slot_ || slot_->truncated) return *this;
+            size_t start = slot_->length;
+            key_prefix(key);
+            append("\"");
+            for (char c : value) {
+                switch (c) {
+                case '"': append("\\\""); break;
+                case '\\': append("\\\\"); break;
+                case '\r': append("\\r"); break;
+                case '\n': append("\\n"); break;
+                case '\t': append("\\t"); break;
+                default:
+                    if (static_cast<unsigned char>(c) < 0x20) {
+                        char escaped[8];
+                        snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+                        append(escaped);
+                    } else {
+                        append(string_view(&c, 1));
+                    }
+                }
+            }
+            append("\"");
+            end_field(start);
+            return *this;
+        }
+
+        Record& field(const char* key, const char* value) { return field(key, string_view(value)); }
+        Record& field(const char* key, const string& value) { return field(key, string_view(value)); }
+
+        template <typename Number, typename = typename enable_if<is_arithmetic<Number>::value>::type>
+        Record& field(const char* key, Number value) {
+            if (!slot_ || slot_->truncated) return *this;
+            size_t start = slot_->length;
+            key_prefix(key);
+            if constexpr (is_floating_point<Number>::value) {
+                // JSON has no NaN or infinity
+                if (!isfinite(value)) {
+                    append("null");
+                    end_field(start);
+                    return *this;
+                }
+            }
+            char digits[32];
+            auto result = to_chars(digits, digits + sizeof(digits), value);
+            append(string_view(digits, result.ptr - digits));
+            end_field(start);
+            return *this;
+        }
+
+    private:
+        void key_prefix(const char* key) {
+            append(",\"");
+            append(key);
+            append("\":");
+        }
+
+        // A field that does not fit is left out as a whole, so the record
+        // stays valid JSON; the writer adds "truncated" and the closing brace
+        void append(string_view text) {
+            if (slot_->truncated || record_capacity - slot_->length < text.size()) {
+                slot_->truncated = true;
+                return;
+            }
+            memcpy(slot_->text + slot_->length, text.data(), text.size());
+            slot_->length += text.size();
+        }
+
+        void end_field(size_t start) {
+            if (slot_->truncated) slot_->length = start;
+        }
+
+        AsyncLogger* logger_;
+        Slot* slot_;
+    };
+
+    // Never destroyed, the io threads may still log while the process exits
+    static AsyncLogger& instance() {
+        static AsyncLogger* logger = new AsyncLogger();
+        return *logger;
+    }
+
+    // Starts the background writer. JSON records go to log_output, dashboard
+    // text to screen_output. At most rate_limit records per second are written
+    // for each event; the rest are counted and reported with the next one.
+    void start(LogLevel level, FILE* log_output, FILE* screen_output, unsigned rate_limit) {
+        level_.store(level, memory_order_relaxed);
+        log_output_ = log_output;
+        screen_output_ = screen_output;
+        rate_limit_ = rate_limit;
+        writer_ = thread([this] { drain_loop(); });
+    }
+
+    bool enabled(LogLevel level) const {
+        return level >= level_.load(memory_order_relaxed);
+    }
+
+    Record log(LogLevel level, const char* event, const string& pair = string()) {
+        if (!enabled(level)) return Record(this, nullptr);
+        size_t position;
+        if (!claim(1, position)) return Record(this, nullptr);
+        Slot* slot = &slots_[position % slot_count];
+        slot->level = level;
+        slot->screen = false;
+        slot->truncated = false;
+        slot->event = event;
+        slot->time = std::chrono::system_clock::now();
+        slot->length = 0;
+        Record record(this, slot);
+        if (!pair.empty()) record.field("pair", pair);
+        return record;
+    }
+
+    // A frame is split over consecutive slots, claimed at once so frames of
+    // different pairs never interleave
+    void screen(string_view text) {
+        size_t count = min(max<size_t>((text.size() + record_capacity - 1) / record_capacity, 1), max_screen_slots);
+        size_t position;
+        if (!claim(count, position)) return;
+        for (size_t i = 0; i < count; ++i) {
+            Slot* slot = &slots_[(position + i) % slot_count];
+            slot->screen = true;
+            slot->length = min(text.size(), record_capacity);
+            memcpy(slot->text, text.data(), slot->length);
+            text.remove_prefix(slot->length);
+            publish(slot);
+        }
+    }
+
+    // Under --realtime: the slots are only touched as records wrap around
+    void lock_ring() {
+        realtime::lock_range(slots_, sizeof(slots_));
+    }
+
+    // Call once the threads that log have finished: writes what is left
+    // and joins the writer thread
+    void stop() {
+        if (!writer_.joinable()) return;
+        stopping_ = true;
+        writer_.join();
+    }
+
+private:
+    AsyncLogger() {
+        for (size_t i = 0; i < slot_count; ++i) slots_[i].sequence.store(i, memory_order_relaxed);
+    }
+
+    // Bounded MPMC queue after Dmitry Vyukov: a slot is free for position p
+    // when its sequence equals p, and holds a record when it equals p + 1.
+    // The writer frees slots in order, so count slots starting at position
+    // are free when the last of them is.
+    bool claim(size_t count, size_t& first) {
+        size_t position = enqueue_.load(memory_order_relaxed);
+        for (;;) {
+            size_t last = position + count - 1;
+            size_t sequence = slots_[last % slot_count].sequence.load(memory_order_acquire);
+            intptr_t difference = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(last);
+            if (difference == 0) {
+                if (enqueue_.compare_exchange_weak(position, position + count, memory_order_relaxed)) {
+                    first = position;
+                    return true;
                 }
-                temp >>= 1;
+            } else if (difference < 0) {
+                dropped_.fetch_add(1, memory_order_relaxed);
+                return false;
+            } else {
+                position = enqueue_.load(memory_order_relaxed);
+            }
+        }
+    }
+
+    void publish(Slot* slot) {
+        size_t position = slot->sequence.load(memory_order_relaxed);
+        slot->sequence.store(position + 1, memory_order_release);
+    }
+
+    void drain_loop() {
+        for (;;) {
+            bool idle = true;
+            for (;;) {
+                Slot& slot = slots_[dequeue_ % slot_count];
+                if (slot.sequence.load(memory_order_acquire) != dequeue_ + 1) break;
+                write(slot);
+                slot.sequence.store(dequeue_ + slot_count, memory_order_release);
+                ++dequeue_;
+                idle = false;
+            }
+            report_dropped();
+            if (!idle) {
+                fflush(log_output_);
+                fflush(screen_output_);
+            } else if (stopping_) {
+                return;
+            } else {
+                this_thread::sleep_for(std::chrono::milliseconds(20));
             }
-            table[i] = value;
         }
     }
 
-    unsigned short ComputeChecksum(const std::vector<unsigned char>& bytes) {
-        unsigned short crc = 0;
-        for (size_t i = 0; i < bytes.size(); ++i) {
-            unsigned char index = static_cast<unsigned char>(crc ^ bytes[i]);
-            crc = static_cast<unsigned short>((crc >> 8) ^ table[index]);
+    void write(const Slot& slot) {
+        if (slot.screen) {
+            fwrite(slot.text, 1, slot.length, screen_output_);
+            return;
         }
-        return crc;
+
+        // Rate limit per event, in one second windows
+        time_t second = std::chrono::system_clock::to_time_t(slot.time);
+        RateWindow& window = windows_[slot.event];
+        if (window.second != second) {
+            window.second = second;
+            window.written = 0;
+        }
+        if (rate_limit_ && window.written >= rate_limit_) {
+            ++window.suppressed;
+            return;
+        }
+        ++window.written;
+
+        static const char* const level_names[] = {"debug", "info", "warning", "error"};
+        auto micros = std::chrono::duration_cast<std::chrono::microseconds>(slot.time.time_since_epoch()).count() % 1000000;
+        tm utc;
+        gmtime_r(&second, &utc);
+        char timestamp[40];
+        strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%S", &utc);
+        fprintf(log_output_, "{\"ts\":\"%s.%06ldZ\",\"level\":\"%s\",\"event\":\"%s\"", timestamp, static_cast<long>(micros),
+                level_names[static_cast<int>(slot.level)], slot.event);
+        fwrite(slot.text, 1, slot.length, log_output_);
+        if (slot.truncated) fputs(",\"truncated\":true", log_output_);
+        if (window.suppressed) {
+            fprintf(log_output_, ",\"suppressed\":%lu", static_cast<unsigned long>(window.suppressed));
+            window.suppressed = 0;
+        }
+        fputs("}\n", log_output_);
     }
 
-    std::vector<unsigned char> ComputeChecksumBytes(const std::vector<unsigned char>& bytes) {
-        unsigned short crc = ComputeChecksum(bytes);
-        return { static_cast<unsigned char>(crc & 0xFF), static_cast<unsigned char>((crc >> 8) & 0xFF) };
+    void report_dropped() {
+        uint64_t dropped = dropped_.exchange(0, memory_order_relaxed);
+        if (dropped) {
+            fprintf(log_output_, "{\"level\":\"warning\",\"event\":\"log_dropped\",\"count\":%lu}\n", static_cast<unsigned long>(dropped));
+        }
     }
+
+    struct RateWindow {
+        time_t second = 0;
+        unsigned written = 0;
+        uint64_t suppressed = 0;
+    };
+
+    Slot slots_[slot_count];
+    atomic<size_t> enqueue_{0};
+    size_t dequeue_ = 0;
+    atomic<uint64_t> dropped_{0};
+    atomic<LogLevel> level_{LogLevel::info};
+    atomic<bool> stopping_{false};
+    FILE* log_output_ = stderr;
+    FILE* screen_output_ = stdout;
+    unsigned rate_limit_ = 0;
+    map<const char*, RateWindow> windows_;  // Keyed by the event's string literal
+    thread writer_;
+};
+
+// Counters and histograms for the hot path. Recording is a relaxed atomic
+// add, so the io threads never wait for the metrics endpoint.
+class Counter {
+public:
+    void add(uint64_t n = 1) { value_.fetch_add(n, memory_order_relaxed); }
+    void set(uint64_t n) { value_.store(n, memory_order_relaxed); }
+    void raise(uint64_t n) {
+        uint64_t current = value_.load(memory_order_relaxed);
+        while (current < n && !value_.compare_exchange_weak(current, n, memory_order_relaxed)) {}
+    }
+    uint64_t value() const { return value_.load(memory_order_relaxed); }
+
+private:
+    atomic<uint64_t> value_{0};
+};
+
+class Histogram {
+public:
+    // Upper bounds in seconds, from 1 us (CRC of one telegram) up to 10 s
+    // (a telegram waiting for the next timer tick)
+    static constexpr double bounds[] = {1e-6, 2.5e-6, 5e-6, 1e-5, 2.5e-5, 5e-5, 1e-4, 2.5e-4, 5e-4, 1e-3, 2.5e-3,
+                                        5e-3, 1e-2, 2.5e-2, 5e-2, 0.1, 0.25, 0.5, 1, 2.5, 5, 10};
+    static constexpr size_t bucket_count = sizeof(bounds) / sizeof(bounds[0]);
+
+    void observe(std::chrono::nanoseconds duration) {
+        double seconds = std::chrono::duration<double>(duration).count();
+        size_t bucket = 0;
+        while (bucket < bucket_count && seconds > bounds[bucket]) ++bucket;
+        buckets_[bucket].add();
+        uint64_t ns = static_cast<uint64_t>(max<std::chrono::nanoseconds::rep>(duration.count(), 0));
+        sum_ns_.add(ns);
+        max_ns_.raise(ns);
+    }
+
+    // Upper bound of the bucket holding quantile q, in seconds; the maximum
+    // seen when that is the overflow bucket. 0 without observations.
+    double quantile(double q) const {
+        uint64_t total = 0;
+        for (const Counter& bucket : buckets_) total += bucket.value();
+        if (total == 0) return 0;
+        uint64_t cumulative = 0;
+        for (size_t i = 0; i < bucket_count; ++i) {
+            cumulative += buckets_[i].value();
+            if (cumulative >= q * total) return min(bounds[i], max_seconds());
+        }
+        return max_seconds();
+    }
+
+    double max_seconds() const {
+        return max_ns_.value() / 1e9;
+    }
+
+    // Prometheus text format; buckets are cumulative there
+    void render(ostream& out, const string& name, const string& labels) const {
+        uint64_t cumulative = 0;
+        for (size_t i = 0; i <= bucket_count; ++i) {
+            cumulative += buckets_[i].value();
+            out << name << "_bucket{" << labels << (labels.empty() ? "" : ",") << "le=\"";
+            if (i < bucket_count) out << bounds[i];
+            else out << "+Inf";
+            out << "\"} " << cumulative << "\n";
+        }
+        string braces = labels.empty() ? "" : "{" + labels + "}";
+        out << name << "_sum" << braces << " " << sum_ns_.value() / 1e9 << "\n";
+        out << name << "_count" << braces << " " << cumulative << "\n";
+    }
+
+private:
+    Counter buckets_[bucket_count + 1];
+    Counter sum_ns_;
+    Counter max_ns_;
+};
+
+// Everything measured for one port pair
+struct PairMetrics {
+    explicit PairMetrics(const string& name) : name(name) {}
+
+    const string name;
+    Counter bytes_in;
+    Counter bytes_out;
+    Counter telegrams_in;
+    Counter telegrams_out;
+    Counter telegrams_skipped;
+    Counter crc_errors;
+    Counter oversize;
+    Counter resyncs;
+    Counter write_errors;
+    Counter queue_depth;
+    Histogram queue_wait;
+    Histogram write;
+    Counter read_wakeups;
+    Counter ticks_skipped;
+    Histogram tick_lateness;
+    Counter telegram_wakeups;
+    Histogram receive;
+    Histogram end_to_end;
+    Histogram read_to_write;
+    Histogram parse;
+    Histogram encode;
+    Histogram crc;
+};
+
+// Pairs register once at startup; rendering walks the list under the lock,
+// the io threads only touch their own PairMetrics.
+class MetricsRegistry {
+public:
+    static MetricsRegistry& instance() {
+        static MetricsRegistry registry;
+        return registry;
+    }
+
+    shared_ptr<PairMetrics> add(const string& name) {
+        lock_guard<mutex> guard(mutex_);
+        pairs_.push_back(make_shared<PairMetrics>(name));
+        return pairs_.back();
+    }
+
+    string render() const {
+        lock_guard<mutex> guard(mutex_);
+        ostringstream out;
+        counter(out, "laadpaal_bytes_in_total", "Bytes read from the meter port", &PairMetrics::bytes_in);
+        counter(out, "laadpaal_bytes_out_total", "Bytes written to the charger port", &PairMetrics::bytes_out);
+        counter(out, "laadpaal_telegrams_in_total", "Valid telegrams received from the meter", &PairMetrics::telegrams_in);
+        counter(out, "laadpaal_telegrams_out_total", "Telegrams written to the charger", &PairMetrics::telegrams_out);
+        counter(out, "laadpaal_telegrams_skipped_total", "Queued telegrams replaced by a newer one before the port was free", &PairMetrics::telegrams_skipped);
+        counter(out, "laadpaal_crc_errors_total", "Telegrams rejected for a bad CRC", &PairMetrics::crc_errors);
+        counter(out, "laadpaal_oversize_frames_total", "Frames dropped for exceeding the framer buffer", &PairMetrics::oversize);
+        counter(out, "laadpaal_resyncs_total", "Times the framer lost sync with the telegram stream", &PairMetrics::resyncs);
+        counter(out, "laadpaal_write_errors_total", "Failed writes to the charger port", &PairMetrics::write_errors);
+        counter(out, "laadpaal_write_queue_depth", "Telegrams being written to the charger port or waiting for it (at most 2)", &PairMetrics::queue_depth, "gauge");
+        counter(out, "laadpaal_ticks_skipped_total", "10 s ticks skipped because the process was not running on time", &PairMetrics::ticks_skipped);
+        histogram(out, "laadpaal_tick_lateness_seconds", "How late the 10 s tick ran compared to its schedule", &PairMetrics::tick_lateness);
+        counter(out, "laadpaal_read_wakeups_total", "Read completions on the meter port", &PairMetrics::read_wakeups);
+        counter(out, "laadpaal_telegram_wakeups", "Read completions that made up the last meter telegram", &PairMetrics::telegram_wakeups, "gauge");
+        histogram(out, "laadpaal_receive_seconds", "Time from the read with the first byte of a meter telegram to the read completing it", &PairMetrics::receive);
+        histogram(out, "laadpaal_end_to_end_seconds", "Time from the read with the first byte of a meter telegram to the charger write finishing", &PairMetrics::end_to_end);
+        histogram(out, "laadpaal_queue_wait_seconds", "Time a telegram waited for the previous write to the charger port", &PairMetrics::queue_wait);
+        histogram(out, "laadpaal_write_seconds", "Time one write to the charger port took", &PairMetrics::write);
+        histogram(out, "laadpaal_read_to_write_seconds", "Time from a complete meter telegram to the charger write finishing", &PairMetrics::read_to_write);
+        histogram(out, "laadpaal_parse_seconds", "Time to parse one telegram", &PairMetrics::parse);
+        histogram(out, "laadpaal_encode_seconds", "Time to build or patch one outgoing telegram", &PairMetrics::encode);
+        histogram(out, "laadpaal_crc_seconds", "Time to check the CRC of one incoming telegram", &PairMetrics::crc);
+        return out.str();
+    }
+
+private:
+    static string labels(const PairMetrics& pair) {
+        return pair.name.empty() ? string() : "pair=\"" + pair.name + "\"";
+    }
+
+    void counter(ostream& out, const char* name, const char* help, Counter PairMetrics::* member, const char* type = "counter") const {
+        out << "# HELP " << name << " " << help << "\n# TYPE " << name << " " << type << "\n";
+        for (const auto& pair : pairs_) {
+            string pair_labels = labels(*pair);
+            out << name << (pair_labels.empty() ? "" : "{" + pair_labels + "}") << " " << ((*pair).*member).value() << "\n";
+        }
+    }
+
+    void histogram(ostream& out, const char* name, const char* help, Histogram PairMetrics::* member) const {
+        out << "# HELP " << name << " " << help << "\n# TYPE " << name << " histogram\n";
+        for (const auto& pair : pairs_) ((*pair).*member).render(out, name, labels(*pair));
+    }
+
+    mutable mutex mutex_;
+    vector<shared_ptr<PairMetrics>> pairs_;
+};
+
+// Minimal HTTP/1.0 responder for Prometheus scrapes, on a TCP port or a Unix
+// socket. Every request gets the full metrics page and the connection is closed.
+template <typename Protocol>
+class MetricsServer {
+public:
+    MetricsServer(io_service& io, const typename Protocol::endpoint& endpoint)
+        : strand_(make_strand(io)), acceptor_(strand_, endpoint) {
+        accept();
+    }
+
+private:
+    // A client that never finishes its request must not hold a connection
+    // or grow its buffer on the io threads the serial ports run on
+    static constexpr size_t max_request_bytes = 8192;
+    static constexpr std::chrono::seconds request_timeout{5};
+
+    struct Connection {
+        explicit Connection(boost::asio::strand<io_service::executor_type>& strand)
+            : socket(strand), deadline(strand), request(max_request_bytes) {}
+        typename Protocol::socket socket;
+        boost::asio::steady_timer deadline;
+        boost::asio::streambuf request;
+        string response;
+    };
+
+    void accept() {
+        auto connection = make_shared<Connection>(strand_);
+        acceptor_.async_accept(connection->socket, [this, connection](boost::system::error_code ec) {
+            if (!ec) serve(connection);
+            accept();
+        });
+    }
+
+    void serve(shared_ptr<Connection> connection) {
+        // Covers reading the request and writing the response
+        connection->deadline.expires_after(request_timeout);
+        connection->deadline.async_wait([connection](boost::system::error_code ec) {
+            if (ec) return;
+            boost::system::error_code ignored;
+            connection->socket.close(ignored);
+        });
+        async_read_until(connection->socket, connection->request, "\r\n\r\n",
+            [connection](boost::system::error_code ec, size_t) {
+                // Also a request larger than max_request_bytes
+                if (ec) {
+                    connection->deadline.cancel();
+                    return;
+                }
+                istream request(&connection->request);
+                string method, path;
+                request >> method >> path;
+                string body = path == "/metrics" || path == "/" ? MetricsRegistry::instance().render() : string();
+                ostringstream response;
+                if (body.empty()) {
+                    response << "HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\n\r\n";
+                } else {
+                    response << "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                             << "Content-Length: " << body.size() << "\r\n\r\n" << body;
+                }
+                connection->response = response.str();
+                async_write(connection->socket, buffer(connection->response),
+                    [connection](boost::system::error_code, size_t) {
+                        connection->deadline.cancel();
+                        boost::system::error_code ignored;
+                        connection->socket.shutdown(Protocol::socket::shutdown_both, ignored);
+                    });
+            });
+    }
+
+    boost::asio::strand<io_service::executor_type> strand_;
+    typename Protocol::acceptor acceptor_;
+};
+
+// "unix:/path/to.sock" or "host:port", e.g. "127.0.0.1:9464"
+shared_ptr<void> start_metrics_server(io_service& io, const string& address) {
+    if (address.compare(0, 5, "unix:") == 0) {
+        string path = address.substr(5);
+        ::unlink(path.c_str());
+        return make_shared<MetricsServer<local::stream_protocol>>(io, local::stream_protocol::endpoint(path));
+    }
+    size_t colon = address.rfind(':');
+    if (colon == string::npos) throw invalid_argument("Invalid metrics address " + address);
+    ip::tcp::endpoint endpoint(ip::make_address(address.substr(0, colon)), static_cast<unsigned short>(stoi(address.substr(colon + 1))));
+    return make_shared<MetricsServer<ip::tcp>>(io, endpoint);
+}
+
+// Optional behaviour, set from the "--" command line options
+struct ReaderWriterOptions {
+    bool passthrough = false;  // Forward each meter telegram instead of rebuilding one every 10 s
+    string capture_path;       // Record raw bytes from the read port, see p1_capture.h
+    string shm_name;           // Publish every telegram in shared memory, see p1_snapshot.h
+    bool shm_checksum = false; // Store a checksum with every snapshot, for p1snapshot --stress
+    string history_path;       // Keep every telegram in a memory-mapped history, see p1_history.h
+    p1_history::Sizes history_sizes;  // Days kept per ring when the history file is created
+    serial_tuning::Settings tuning;  // Low latency flag, latency timer and read wakeup, see serial_tuning.h
+    string name;               // Label for the table when several port pairs share a process
+    bool clear_screen = true;  // Only a single pair owns the whole terminal
+    bool headless = false;     // No dashboard, a periodic "status" log record instead
+    ControllerSettings controller;  // Limits of 0 or above the current limit become the current limit
 };
 
 class SerialReaderWriter {
@@ -76,9 +700,22 @@ public:
                        const string& write_port, int write_baud_rate,
                        const string& read_parity, const string& read_stop_bits, int read_data_bits,
                        const string& write_parity, const string& write_stop_bits, int write_data_bits,
-                       double current_limit, const bool& car_charging_three_phases)
-        : serial_read(io, read_port), serial_write(io, write_port), timer(io, boost::posix_time::seconds(10)), io_service_(io), running(true), current_limit_(current_limit) {
-        
+                       double current_limit, const bool& car_charging_three_phases,
+                       const ReaderWriterOptions& options = ReaderWriterOptions())
+        : strand_(make_strand(io)), serial_read(strand_, read_port), serial_write(strand_, write_port), timer(strand_, tick_period), io_service_(io), running(true),
+          passthrough_(options.passthrough), name_(options.name), clear_screen_(options.clear_screen), headless_(options.headless),
+          metrics_(MetricsRegistry::instance().add(options.name)), feed_(options.controller, current_limit, car_charging_three_phases) {
+        if (!options.capture_path.empty()) {
+            capture_.reset(new p1_capture::Writer(options.capture_path));
+        }
+        if (!options.history_path.empty()) {
+            history_.reset(new p1_history::HistoryWriter(options.history_path, options.history_sizes));
+        }
+        outbound_.reserve(TelegramFramer::capacity);
+        if (!options.shm_name.empty()) {
+            snapshot_writer_.reset(new p1_snapshot::SnapshotWriter(options.shm_name, options.shm_checksum));
+        }
+
         serial_read.set_option(serial_port_base::baud_rate(read_baud_rate));
         serial_read.set_option(serial_port_base::character_size(read_data_bits));
         serial_read.set_option(serial_port_base::parity(get_parity(read_parity)));
@@ -90,20 +727,63 @@ public:
         serial_write.set_option(serial_port_base::parity(get_parity(write_parity)));
         serial_write.set_option(serial_port_base::stop_bits(get_stop_bits(write_stop_bits)));
         serial_write.set_option(serial_port_base::flow_control(serial_port_base::flow_control::none));
-        threePhases = car_charging_three_phases;
+
+        // After set_option, which rewrites the termios settings
+        read_tuning_.reset(new serial_tuning::PortTuning(serial_read.native_handle(), read_port, options.tuning, true));
+        write_tuning_.reset(new serial_tuning::PortTuning(serial_write.native_handle(), write_port, options.tuning, false));
+        AsyncLogger::instance().log(LogLevel::info, "pair_started", name_)
+            .field("read_port", read_port).field("write_port", write_port).field("passthrough", passthrough_ ? "yes" : "no");
+        for (auto tuned : {make_pair("read", read_tuning_.get()), make_pair("write", write_tuning_.get())}) {
+            const serial_tuning::Report& report = tuned.second->report();
+            AsyncLogger::instance().log(LogLevel::info, "port_tuning", name_).field("port", tuned.first)
+                .field("low_latency", report.low_latency).field("latency_timer", report.latency_timer).field("wakeup", report.wakeup);
+        }
         start_read();
         start_timer();
     }
 
     void start_read() {
-        serial_read.async_read_some(buffer(buffer_read),
+        serial_read.async_read_some(framer.prepare(),
             [this](boost::system::error_code ec, std::size_t length) {
                 if (!ec && running) {
-                    string data(buffer_read.data(), length);
-                    process_received_data(data);
+                    auto woke_at = std::chrono::steady_clock::now();
+                    if (!framer.pending()) {
+                        telegram_started_at_ = woke_at;
+                        telegram_wakeups_ = 0;
+                    }
+                    ++telegram_wakeups_;
+                    metrics_->read_wakeups.add();
+                    string_view received = framer.commit(length);
+                    if (capture_) capture_->write(received.data(), received.size());
+                    metrics_->bytes_in.add(length);
+                    string_view telegram;
+                    while (framer.next(telegram)) {
+                        telegram_received_at_ = std::chrono::steady_clock::now();
+                        telegram_first_byte_at_ = telegram_started_at_;
+                        metrics_->receive.observe(telegram_received_at_ - telegram_started_at_);
+                        metrics_->telegram_wakeups.set(telegram_wakeups_);
+                        // Whatever follows in this read starts the next telegram
+                        telegram_started_at_ = woke_at;
+                        telegram_wakeups_ = 1;
+                        metrics_->crc.observe(framer.stats().last_crc_time);
+                        feed_.receive(telegram);
+                        metrics_->parse.observe(std::chrono::steady_clock::now() - telegram_received_at_);
+                        feed_.control(telegram_received_at_);
+                        if (snapshot_writer_) publish_snapshot();
+                        if (history_) {
+                            history_->append(feed_.values(), std::chrono::duration_cast<std::chrono::milliseconds>(
+                                std::chrono::system_clock::now().time_since_epoch()).count());
+                        }
+                        if (passthrough_) forward_telegram(telegram);
+                    }
+                    const TelegramFramer::Stats& stats = framer.stats();
+                    metrics_->telegrams_in.set(stats.telegrams);
+                    metrics_->crc_errors.set(stats.crc_errors);
+                    metrics_->oversize.set(stats.oversize);
+                    metrics_->resyncs.set(stats.resyncs);
                     start_read();  // Start the next read operation
                 } else if (ec) {
-                    cerr << "Error: " << ec.message() << endl;
+                    AsyncLogger::instance().log(LogLevel::error, "read_error", name_).field("message", ec.message());
                 }
             });
     }
@@ -112,220 +792,204 @@ public:
         timer.async_wait(boost::bind(&SerialReaderWriter::on_timer, this));
     }
 
+    // The tick follows a fixed grid on the monotonic clock: it does not
+    // drift with handler time or jump with the wall clock. Ticks that were
+    // missed, e.g. while the machine was suspended, are skipped instead of
+    // run back to back.
     void on_timer() {
         if (running) {
-            // Calculate generation	
-	        calc_current(threePhases);            
+            auto now = std::chrono::steady_clock::now();
+            metrics_->tick_lateness.observe(now - timer.expiry());
             display_table();
-			send_data();
-            timer.expires_at(timer.expires_at() + boost::posix_time::seconds(10));
+            if (!passthrough_) send_data();
+            if (capture_) capture_->flush();
+            auto next = timer.expiry() + tick_period;
+            while (next <= now) {
+                next += tick_period;
+                metrics_->ticks_skipped.add();
+            }
+            timer.expires_at(next);
             start_timer();
         }
     }
 
-    void process_received_data(const string& data) {
-        smatch match;
-        
-        // Regular expressions to extract the additional values
-		regex regex_id(R"(/(.*)\r\n)");
-        regex regex_0_2_8(R"(1-3:0\.2\.8\(([\d\.]+)\))");
-        regex regex_1_0_0(R"(0-0:1\.0\.0\(([\d\.]+[SW])\))");
-        regex regex_96_1_1(R"(0-0:96\.1\.1\(([\d\.]+)\))");
-        regex regex_1_8_1(R"(1-0:1\.8\.1\(([\d\.]+)\*kWh\))");
-        regex regex_1_8_2(R"(1-0:1\.8\.2\(([\d\.]+)\*kWh\))");
-        regex regex_2_8_1(R"(1-0:2\.8\.1\(([\d\.]+)\*kWh\))");
-        regex regex_2_8_2(R"(1-0:2\.8\.2\(([\d\.]+)\*kWh\))");
-        regex regex_96_14_0(R"(0-0:96\.14\.0\((\d+)\))");
-        regex regex_1_7_0(R"(1-0:1\.7\.0\(([\d\.]+)\*kW\))");
-        regex regex_2_7_0(R"(1-0:2\.7\.0\(([\d\.]+)\*kW\))");
-        regex regex_96_7_21(R"(0-0:96\.7\.21\((\d+)\))");
-        regex regex_96_7_9(R"(0-0:96\.7\.9\((\d+)\))");
-        regex regex_99_97_0(R"(1-0:99\.97\.0\((.+)\))");
-        regex regex_32_32_0(R"(1-0:32\.32\.0\((\d+)\))");
-        regex regex_52_32_0(R"(1-0:52\.32\.0\((\d+)\))");
-        regex regex_72_32_0(R"(1-0:72\.32\.0\((\d+)\))");
-        regex regex_32_36_0(R"(1-0:32\.36\.0\((\d+)\))");
-        regex regex_52_36_0(R"(1-0:52\.36\.0\((\d+)\))");
-        regex regex_72_36_0(R"(1-0:72\.36\.0\((\d+)\))");
-        regex regex_32_7_0(R"(1-0:32\.7\.0\(([\d\.]+)\*V\))");
-        regex regex_52_7_0(R"(1-0:52\.7\.0\(([\d\.]+)\*V\))");
-        regex regex_72_7_0(R"(1-0:72\.7\.0\(([\d\.]+)\*V\))");
-		regex regex_31_7_0(R"(1-0:31\.7\.0\(([\d\.]+)\*A\))");
-        regex regex_51_7_0(R"(1-0:51\.7\.0\(([\d\.]+)\*A\))");
-        regex regex_71_7_0(R"(1-0:71\.7\.0\(([\d\.]+)\*A\))");
-        regex regex_21_7_0(R"(1-0:21\.7\.0\(([\d\.]+)\*kW\))");
-        regex regex_41_7_0(R"(1-0:41\.7\.0\(([\d\.]+)\*kW\))");
-        regex regex_61_7_0(R"(1-0:61\.7\.0\(([\d\.]+)\*kW\))");
-        regex regex_22_7_0(R"(1-0:22\.7\.0\(([\d\.]+)\*kW\))");
-        regex regex_42_7_0(R"(1-0:42\.7\.0\(([\d\.]+)\*kW\))");
-        regex regex_62_7_0(R"(1-0:62\.7\.0\(([\d\.]+)\*kW\))");
-
-        // Extract additional values and store them in variables
-		if (regex_search(data, match, regex_id)) value_id = match[1];
-        if (regex_search(data, match, regex_0_2_8)) value_0_2_8 = stod(match[1]);
-        if (regex_search(data, match, regex_1_0_0)) value_1_0_0 = match[1];
-        if (regex_search(data, match, regex_96_1_1)) value_96_1_1 = match[1];
-        if (regex_search(data, match, regex_1_8_1)) value_1_8_1 = stod(match[1]);
-        if (regex_search(data, match, regex_1_8_2)) value_1_8_2 = stod(match[1]);
-        if (regex_search(data, match, regex_2_8_1)) value_2_8_1 = stod(match[1]);
-        if (regex_search(data, match, regex_2_8_2)) value_2_8_2 = stod(match[1]);
-        if (regex_search(data, match, regex_96_14_0)) value_96_14_0 = stoi(match[1]);
-        if (regex_search(data, match, regex_1_7_0)) value_1_7_0 = stod(match[1]);
-        if (regex_search(data, match, regex_2_7_0)) value_2_7_0 = stod(match[1]);
-        if (regex_search(data, match, regex_96_7_21)) value_96_7_21 = stoi(match[1]);
-        if (regex_search(data, match, regex_96_7_9)) value_96_7_9 = stoi(match[1]);
-        if (regex_search(data, match, regex_99_97_0)) value_99_97_0 = match[1];
-        if (regex_search(data, match, regex_32_32_0)) value_32_32_0 = stoi(match[1]);
-        if (regex_search(data, match, regex_52_32_0)) value_52_32_0 = stoi(match[1]);
-        if (regex_search(data, match, regex_72_32_0)) value_72_32_0 = stoi(match[1]);
-        if (regex_search(data, match, regex_32_36_0)) value_32_36_0 = stoi(match[1]);
-        if (regex_search(data, match, regex_52_36_0)) value_52_36_0 = stoi(match[1]);
-        if (regex_search(data, match, regex_72_36_0)) value_72_36_0 = stoi(match[1]);
-        if (regex_search(data, match, regex_32_7_0)) value_32_7_0 = stod(match[1]);
-        if (regex_search(data, match, regex_52_7_0)) value_52_7_0 = stod(match[1]);
-        if (regex_search(data, match, regex_72_7_0)) value_72_7_0 = stod(match[1]);
-        if (regex_search(data, match, regex_31_7_0)) value_31_7_0 = min(stod(match[1]), current_limit_);
-        if (regex_search(data, match, regex_51_7_0)) value_51_7_0 = min(stod(match[1]), current_limit_);
-        if (regex_search(data, match, regex_71_7_0)) value_71_7_0 = min(stod(match[1]), current_limit_);
-        if (regex_search(data, match, regex_21_7_0)) value_21_7_0 = stod(match[1]);
-        if (regex_search(data, match, regex_41_7_0)) value_41_7_0 = stod(match[1]);
-        if (regex_search(data, match, regex_61_7_0)) value_61_7_0 = stod(match[1]);
-        if (regex_search(data, match, regex_22_7_0)) value_22_7_0 = stod(match[1]);
-        if (regex_search(data, match, regex_42_7_0)) value_42_7_0 = stod(match[1]);
-        if (regex_search(data, match, regex_62_7_0)) value_62_7_0 = stod(match[1]);
-
-    }
-
-    double calc_generation(const double& consumption, const double& generation, const double& current, const double& initialValue, const bool& threePhase) 
-    {
-       double calcValue=0.0;
-	   double currentCalc = current;
-	   if (threePhase) {
-		   currentCalc = current / 3;
-	   }
-       if (consumption-generation > 0) {
-           calcValue = initialValue - currentCalc;
-       }
-       else if (consumption-generation < 0) {
-           calcValue = initialValue + currentCalc;
-       }
-       else {
-           calcValue = initialValue;
-       }	   
-       if (calcValue > current_limit_) {
-           calcValue = current_limit_;
-       }
-       if (calcValue < 0) {
-           calcValue = 0;
-       }
-       return calcValue;
-    }
-
-    bool is_generating(const double& generation) {
-		return (generation > 0);
-	}
-    void calc_current(const bool& threePhase) {
-        mod_31_7_0 = calc_generation(value_21_7_0 + value_41_7_0 + value_61_7_0, value_22_7_0 + value_42_7_0 + value_62_7_0, value_31_7_0 + value_51_7_0 + value_71_7_0, mod_31_7_0, threePhase);
-        mod_51_7_0 = calc_generation(value_21_7_0 + value_41_7_0 + value_61_7_0, value_22_7_0 + value_42_7_0 + value_62_7_0, value_31_7_0 + value_51_7_0 + value_71_7_0, mod_51_7_0, threePhase);
-        mod_71_7_0 = calc_generation(value_21_7_0 + value_41_7_0 + value_61_7_0, value_22_7_0 + value_42_7_0 + value_62_7_0, value_31_7_0 + value_51_7_0 + value_71_7_0, mod_71_7_0, threePhase);
+    // The framer, encoder and outbound buffers are reserved at startup but
+    // first written with a telegram; under mlockall(MCL_ONFAULT) that would
+    // fault on the hot path
+    void lock_buffers() {
+        realtime::lock_range(this, sizeof(*this));
+        realtime::lock_range(outbound_.data(), outbound_.capacity());
     }
 
-    void send_data() {
-        stringstream modified_telegram;
-
-        // Construct the telegram with updated values
-        modified_telegram << "/" << value_id << "\r\n\r\n"
-                          << "1-3:0.2.8(" << value_0_2_8 << ")\r\n"
-                          << "0-0:1.0.0(" << value_1_0_0 << ")\r\n"
-                          << "0-0:96.1.1(" << value_96_1_1 << ")\r\n"
-                          << "1-0:1.8.1(" << fixed << setprecision(3) << value_1_8_1 << "*kWh)\r\n"
-                          << "1-0:1.8.2(" << fixed << setprecision(3) << value_1_8_2 << "*kWh)\r\n"
-                          << "1-0:2.8.1(" << fixed << setprecision(3) << value_2_8_1 << "*kWh)\r\n"
-                          << "1-0:2.8.2(" << fixed << setprecision(3) << value_2_8_2 << "*kWh)\r\n"
-                          << "0-0:96.14.0(" << value_96_14_0 << ")\r\n"
-                          << "1-0:1.7.0(" << fixed << setprecision(3) << value_1_7_0 << "*kW)\r\n"
-                          << "1-0:2.7.0(" << fixed << setprecision(3) << value_2_7_0 << "*kW)\r\n"
-                          << "0-0:96.7.21(" << value_96_7_21 << ")\r\n"
-                          << "0-0:96.7.9(" << value_96_7_9 << ")\r\n"
-                          << "1-0:99.97.0(" << value_99_97_0 << ")\r\n"
-                          << "1-0:32.32.0(" << value_32_32_0 << ")\r\n"
-                          << "1-0:52.32.0(" << value_52_32_0 << ")\r\n"
-                          << "1-0:72.32.0(" << value_72_32_0 << ")\r\n"
-                          << "1-0:32.36.0(" << value_32_36_0 << ")\r\n"
-                          << "1-0:52.36.0(" << value_52_36_0 << ")\r\n"
-                          << "1-0:72.36.0(" << value_72_36_0 << ")\r\n"
-                          << "1-0:32.7.0(" << fixed << setprecision(3) << value_32_7_0 << "*V)\r\n"
-                          << "1-0:52.7.0(" << fixed << setprecision(3) << value_52_7_0 << "*V)\r\n"
-                          << "1-0:72.7.0(" << fixed << setprecision(3) << value_72_7_0 << "*V)\r\n"
-                          << "1-0:31.7.0(" << fixed << setprecision(3) << current_limit_ - mod_31_7_0 << "*A)\r\n"
-                          << "1-0:51.7.0(" << fixed << setprecision(3) << current_limit_ - mod_51_7_0 << "*A)\r\n"
-                          << "1-0:71.7.0(" << fixed << setprecision(3) << current_limit_ - mod_71_7_0 << "*A)\r\n"
-                          << "1-0:21.7.0(" << fixed << setprecision(3) << value_21_7_0 << "*kW)\r\n"
-                          << "1-0:41.7.0(" << fixed << setprecision(3) << value_41_7_0 << "*kW)\r\n"
-                          << "1-0:61.7.0(" << fixed << setprecision(3) << value_61_7_0 << "*kW)\r\n"
-                          << "1-0:22.7.0(" << fixed << setprecision(3) << value_22_7_0 << "*kW)\r\n"
-                          << "1-0:42.7.0(" << fixed << setprecision(3) << value_42_7_0 << "*kW)\r\n"
-                          << "1-0:62.7.0(" << fixed << setprecision(3) << value_62_7_0 << "*kW)\r\n"
-                          << "!";
-
-        // Calculate CRC16 checksum for the message
-        string telegram_body = modified_telegram.str();
-        /* uint16_t crc = calculate_crc16(telegram_body);
-        stringstream checksum_stream;
-        checksum_stream << hex << uppercase << crc;
-        string checksum = checksum_stream.str();
-
-        // Add checksum to the telegram
-        telegram_body += checksum + "\r\n";*/
-        std::vector<unsigned char> bytes(telegram_body.begin(), telegram_body.end());
-
-		// Bereken de CRC16 checksum
-		Crc16 crc16;
-		unsigned short checksum = crc16.ComputeChecksum(bytes);
-
-		// Zet de checksum om naar een hexadecimale string
-		std::stringstream ss;
-		ss << std::setw(4) << std::setfill('0') << std::hex << std::uppercase << checksum;
-
-		// Voeg de checksum en CRLF toe aan het telegram
-		telegram_body += ss.str() + "\r\n";
-		cout << telegram_body << endl;
-        // Send the telegram
-        async_write(serial_write, buffer(telegram_body), [](boost::system::error_code ec, std::size_t length) {
-            if (ec) {
-                cerr << "Error writing to serial port: " << ec.message() << endl;
+    // Under mlockall() the history file would end up locked in full
+    void unlock_history() {
+        if (history_) history_->file().unlock();
+    }
+
+    void publish_snapshot() {
+        auto now = std::chrono::system_clock::now().time_since_epoch();
+        snapshot_writer_->publish([&](p1_snapshot::Snapshot& snapshot) {
+            snapshot.telegrams++;
+            snapshot.time_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(now).count();
+            snapshot.current_limit = feed_.current_limit();
+            for (size_t i = 0; i < 3; ++i) {
+                snapshot.setpoints[i] = feed_.controller().output()[i];
+                snapshot.reported[i] = feed_.reported_current(i);
             }
+            snapshot.values = feed_.values();
         });
     }
 
-    uint16_t calculate_crc16(const string& data) {
-        uint16_t crc = 0x0000;
-        for (char c : data) {
-            crc ^= static_cast<uint8_t>(c) << 8;
-            for (int i = 0; i < 8; ++i) {
-                if (crc & 0x8000) {
-                    crc = (crc << 1) ^ 0x1021;
+    void send_data() {
+        // Nothing to rebuild before the first telegram from the meter
+        if (feed_.values().telegrams() == 0) return;
+
+        auto encode_start = std::chrono::steady_clock::now();
+        if (!feed_.rebuild(encoder)) {
+            AsyncLogger::instance().log(LogLevel::error, "telegram_too_large", name_).field("capacity", TelegramEncoder::capacity);
+            return;
+        }
+        string_view telegram = encoder.view();
+        metrics_->encode.observe(std::chrono::steady_clock::now() - encode_start);
+        AsyncLogger::instance().log(LogLevel::debug, "telegram_sent", name_).field("telegram", telegram);
+
+        queue_write(telegram);
+    }
+
+    // Passthrough mode: forward the meter's own telegram as soon as it has
+    // been validated, with only the phase currents replaced
+    void forward_telegram(string_view telegram) {
+        auto encode_start = std::chrono::steady_clock::now();
+        feed_.patch(telegram, outbound_);
+        metrics_->encode.observe(std::chrono::steady_clock::now() - encode_start);
+
+        queue_write(outbound_);
+    }
+
+    // The telegram is copied, the caller may reuse its buffer straight away
+    void queue_write(string_view telegram) {
+        if (!outbound_queue_.push(telegram, telegram_received_at_, telegram_first_byte_at_)) {
+            // The port has not even started on the previous telegram
+            metrics_->telegrams_skipped.add();
+            auto in_flight = std::chrono::steady_clock::now() - outbound_queue_.writing()->queued_at;
+            AsyncLogger::instance().log(LogLevel::warning, "write_busy", name_)
+                .field("in_flight_ms", std::chrono::duration_cast<std::chrono::milliseconds>(in_flight).count());
+        }
+        start_write();
+    }
+
+    void start_write() {
+        const OutboundQueue::Slot* slot = outbound_queue_.start();
+        metrics_->queue_depth.set(outbound_queue_.depth());
+        if (!slot) return;
+        auto started_at = std::chrono::steady_clock::now();
+        metrics_->queue_wait.observe(started_at - slot->queued_at);
+        async_write(serial_write, buffer(slot->data.data(), slot->size),
+            [this, slot, started_at](boost::system::error_code ec, std::size_t length) {
+                auto written_at = std::chrono::steady_clock::now();
+                metrics_->write.observe(written_at - started_at);
+                if (ec) {
+                    metrics_->write_errors.add();
+                    AsyncLogger::instance().log(LogLevel::error, "write_error", name_).field("message", ec.message());
                 } else {
-                    crc <<= 1;
+                    metrics_->bytes_out.add(length);
+                    metrics_->telegrams_out.add();
+                    if (slot->received_at != std::chrono::steady_clock::time_point()) {
+                        metrics_->read_to_write.observe(written_at - slot->received_at);
+                        metrics_->end_to_end.observe(written_at - slot->first_byte_at);
+                    }
                 }
-            }
-        }
-        return crc;
+                outbound_queue_.finish();
+                if (running) start_write();
+                else metrics_->queue_depth.set(outbound_queue_.depth());
+            });
     }
 
+    // Rendered here, written by the logger thread: the io thread never
+    // blocks on the terminal
     void display_table() {
-        system("clear"); // Clear the terminal screen
-        cout << "+-------------------+--------+--------+--------+--------+" << endl;
-        cout << "|                   | Phase 1| Phase 2| Phase 3|   Total|" << endl;
-        cout << "+-------------------+--------+--------+--------+--------+" << endl;
-        cout << "| Current (A)       | " << setw(6) << value_31_7_0 << " | " << setw(6) << value_51_7_0 << " | " << setw(6) << value_71_7_0 << " | " << setw(6) << value_31_7_0 + value_51_7_0 + value_71_7_0 << " |" << endl;
-        cout << "+-------------------+--------+--------+--------+--------+" << endl;
-        cout << "| Consumption (kW)  | " << setw(6) << value_21_7_0 << " | " << setw(6) << value_41_7_0 << " | " << setw(6) << value_61_7_0 << " | " << setw(6) << value_21_7_0 + value_41_7_0 + value_61_7_0 << " |" << endl;
-        cout << "+-------------------+--------+--------+--------+--------+" << endl;
-        cout << "| Generation (kW)   | " << setw(6) << value_22_7_0 << " | " << setw(6) << value_42_7_0 << " | " << setw(6) << value_62_7_0 << " | " << setw(6) << value_22_7_0 + value_42_7_0 + value_62_7_0 << " |" << endl;
-        cout << "+-------------------+--------+--------+--------+--------+" << endl;
-        cout << "| CurrentMod (A)    | " << setw(6) << current_limit_ - mod_31_7_0 << " | " << setw(6) << current_limit_ - mod_51_7_0 << " | " << setw(6) << current_limit_ - mod_71_7_0 << " | " << setw(6) << "" << " |" << endl;
-        cout << "+-------------------+--------+--------+--------+--------+" << endl;
+        const ObisValues& values = feed_.values();
+        const TelegramFramer::Stats& stats = framer.stats();
+        double consumption = 0, generation = 0;
+        for (size_t i = 0; i < 3; ++i) {
+            consumption += values.number(ChargerFeed::phase_delivered[i]);
+            generation += values.number(ChargerFeed::phase_returned[i]);
+        }
+        if (headless_) {
+            AsyncLogger::Record record = AsyncLogger::instance().log(LogLevel::info, "status", name_);
+            if (values.seen(Obis::timestamp)) record.field("timestamp", values.text(Obis::timestamp));
+            for (size_t i = 0; i < obis_field_count; ++i) {
+                Obis id = static_cast<Obis>(i);
+                ObisType type = schema_of(id).type;
+                if (values.seen(id) && type != ObisType::text && type != ObisType::whole_text) {
+                    record.field(schema_of(id).name, values.number(id));
+                }
+            }
+            record.field("consumption_kw", consumption).field("generation_kw", generation)
+                .field("current_mod_l1", feed_.reported_current(0)).field("current_mod_l2", feed_.reported_current(1))
+                .field("current_mod_l3", feed_.reported_current(2))
+                .field("telegrams", stats.telegrams).field("crc_errors", stats.crc_errors)
+                .field("oversize", stats.oversize).field("resyncs", stats.resyncs)
+                .field("telegram_wakeups", metrics_->telegram_wakeups.value())
+                .field("tick_late_p99_ms", metrics_->tick_lateness.quantile(0.99) * 1e3)
+                .field("tick_late_max_ms", metrics_->tick_lateness.max_seconds() * 1e3)
+                .field("read_to_write_p99_ms", metrics_->read_to_write.quantile(0.99) * 1e3)
+                .field("read_to_write_max_ms", metrics_->read_to_write.max_seconds() * 1e3);
+            return;
+        }
+
+        ostringstream table;
+        if (clear_screen_) table << "\033[H\033[J"; // Cursor home, clear the screen
+        if (!name_.empty()) table << name_ << "\n";
+        auto row = [&table](const char* label, double l1, double l2, double l3, bool total) {
+            table << "| " << left << setw(18) << label << right << "| " << setw(6) << l1 << " | " << setw(6) << l2 << " | "
+                  << setw(6) << l3 << " | " << setw(6);
+            if (total) table << l1 + l2 + l3;
+            else table << "";
+            table << " |\n+-------------------+--------+--------+--------+--------+\n";
+        };
+        table << "+-------------------+--------+--------+--------+--------+\n";
+        table << "|                   | Phase 1| Phase 2| Phase 3|   Total|\n";
+        table << "+-------------------+--------+--------+--------+--------+\n";
+        row("Current (A)", feed_.phase_current(0), feed_.phase_current(1), feed_.phase_current(2), true);
+        row("Consumption (kW)", values.number(ChargerFeed::phase_delivered[0]), values.number(ChargerFeed::phase_delivered[1]), values.number(ChargerFeed::phase_delivered[2]), true);
+        row("Generation (kW)", values.number(ChargerFeed::phase_returned[0]), values.number(ChargerFeed::phase_returned[1]), values.number(ChargerFeed::phase_returned[2]), true);
+        row("CurrentMod (A)", feed_.reported_current(0), feed_.reported_current(1), feed_.reported_current(2), false);
+
+        // Everything else the meter sent, marked when the last telegram
+        // did not repeat it
+        for (size_t i = 0; i < obis_field_count; ++i) {
+            Obis id = static_cast<Obis>(i);
+            if (!values.seen(id) || ChargerFeed::in_phase_table(id)) continue;
+            const ObisSchemaEntry& entry = schema_of(id);
+            table << left << setw(26) << entry.name << right;
+            switch (entry.type) {
+            case ObisType::number:
+            case ObisType::mbus:
+                table << fixed << setprecision(entry.decimals) << values.number(id) << defaultfloat << setprecision(6);
+                if (entry.unit) table << " " << entry.unit;
+                break;
+            case ObisType::integer:
+                table << static_cast<long long>(values.number(id));
+                break;
+            case ObisType::mbus_legacy:
+                table << fixed << setprecision(entry.decimals) << values.number(id) << defaultfloat << setprecision(6);
+                break;
+            case ObisType::text:
+            case ObisType::whole_text:
+                table << values.text(id).substr(0, 48);
+                break;
+            }
+            if (!values.fresh(id)) table << " (stale)";
+            table << "\n";
+        }
+        table << "Telegrams: " << stats.telegrams << "  CRC errors: " << stats.crc_errors
+              << "  Oversize: " << stats.oversize << "  Resyncs: " << stats.resyncs
+              << "  Reads per telegram: " << metrics_->telegram_wakeups.value() << "\n"
+              << "Tick late p99/max: " << metrics_->tick_lateness.quantile(0.99) * 1e3 << "/" << metrics_->tick_lateness.max_seconds() * 1e3
+              << " ms  Read to write p99/max: " << metrics_->read_to_write.quantile(0.99) * 1e3 << "/" << metrics_->read_to_write.max_seconds() * 1e3
+              << " ms\n";
+        AsyncLogger::instance().screen(table.str());
     }
 
     void run() {
@@ -338,97 +1002,271 @@ public:
     }
 
 private:
+    // All handlers of one pair run on its strand, so pairs sharing a thread
+    // pool never run concurrently with themselves and never block each other
+    boost::asio::strand<io_service::executor_type> strand_;
     serial_port serial_read;
     serial_port serial_write;
-    deadline_timer timer;
+    // Declared after the ports so they are restored before the ports close
+    unique_ptr<serial_tuning::PortTuning> read_tuning_;
+    unique_ptr<serial_tuning::PortTuning> write_tuning_;
+    static constexpr std::chrono::seconds tick_period{10};
+    boost::asio::steady_timer timer;
     io_service& io_service_;
-    std::array<char, 256> buffer_read;
+    TelegramFramer framer;
+    TelegramEncoder encoder;
+    string outbound_;  // Passthrough telegram being patched, copied into the queue
     bool running;
-    bool threePhases = false;
-    // Variables to hold the extracted data
-	string value_id = "";
-    double value_0_2_8 = 0;
-    string value_1_0_0 = "";
-    string value_96_1_1 = "";
-    double value_1_8_1 = 0.000;
-    double value_1_8_2 = 0.000;
-    double value_2_8_1 = 0.000;
-    double value_2_8_2 = 0.000;
-    int value_96_14_0 = 0;
-    double value_1_7_0 = 0.000;
-    double value_2_7_0 = 0.000;
-    int value_96_7_21 = 0;
-    int value_96_7_9 = 0;
-    string value_99_97_0 = "";
-    int value_32_32_0 = 0;
-    int value_52_32_0 = 0;
-    int value_72_32_0 = 0;
-    int value_32_36_0 = 0;
-    int value_52_36_0 = 0;
-    int value_72_36_0 = 0;
-    double value_32_7_0 = 0.0;
-    double value_52_7_0 = 0.0;
-    double value_72_7_0 = 0.0;
-
-    // Variables for the table values
-    double value_31_7_0 = 0.0;
-    double value_51_7_0 = 0.0;
-    double value_71_7_0 = 0.0;
-    double mod_31_7_0 = 0.0;
-    double mod_51_7_0 = 0.0;
-    double mod_71_7_0 = 0.0;
-    double value_21_7_0 = 0.0;
-    double value_41_7_0 = 0.0;
-    double value_61_7_0 = 0.0;
-    double value_22_7_0 = 0.0;
-    double value_42_7_0 = 0.0;
-    double value_62_7_0 = 0.0;
-
-    double current_limit_;
+    bool passthrough_;
+    string name_;
+    bool clear_screen_;
+    bool headless_;
+    OutboundQueue outbound_queue_;
+    shared_ptr<PairMetrics> metrics_;
+    std::chrono::steady_clock::time_point telegram_received_at_;
+    std::chrono::steady_clock::time_point telegram_first_byte_at_;
+    std::chrono::steady_clock::time_point telegram_started_at_;  // Read that brought the first byte of the unfinished telegram
+    uint64_t telegram_wakeups_ = 0;
+    unique_ptr<p1_capture::Writer> capture_;
+    unique_ptr<p1_snapshot::SnapshotWriter> snapshot_writer_;
+    unique_ptr<p1_history::HistoryWriter> history_;
+    ChargerFeed feed_;
 };
 
+// One meter/charger port pair: the 12 positional arguments of the command
+// line, or one line of a --pairs file
+struct PortPairConfig {
+    string name;
+    string read_port;
+    int read_baud_rate;
+    string write_port;
+    int write_baud_rate;
+    string read_parity;
+    string read_stop_bits;
+    int read_data_bits;
+    string write_parity;
+    string write_stop_bits;
+    int write_data_bits;
+    double current_limit;
+    bool car_charging_three_phases;
+};
+
+PortPairConfig parse_port_pair(const vector<string>& args, const string& name = "") {
+    PortPairConfig pair;
+    pair.name = name;
+    pair.read_port = args[0];
+    pair.read_baud_rate = stoi(args[1]);
+    pair.write_port = args[2];
+    pair.write_baud_rate = stoi(args[3]);
+    pair.read_parity = args[4];
+    pair.read_stop_bits = args[5];
+    pair.read_data_bits = stoi(args[6]);
+    pair.write_parity = args[7];
+    pair.write_stop_bits = args[8];
+    pair.write_data_bits = stoi(args[9]);
+    pair.current_limit = stod(args[10]);
+    const string& car_charging_phases = args[11];
+    if (car_charging_phases == "1 phase") pair.car_charging_three_phases = false;
+    else if (car_charging_phases == "3 phase") pair.car_charging_three_phases = true;
+    else throw invalid_argument("Invalid car_charging_phases option");
+    return pair;
+}
+
+// One pair per line: a name followed by the 12 positional arguments, e.g.
+//     garage /dev/ttyUSB0 115200 /dev/ttyUSB1 115200 none one 8 none one 8 25 3 phase
+// Empty lines and lines starting with '#' are skipped.
+vector<PortPairConfig> read_port_pairs(const string& path) {
+    ifstream file(path);
+    if (!file) throw invalid_argument("Cannot open " + path);
+    vector<PortPairConfig> pairs;
+    string line;
+    for (int number = 1; getline(file, line); ++number) {
+        istringstream fields(line);
+        vector<string> args;
+        for (string field; fields >> field;) args.push_back(field);
+        if (args.empty() || args[0][0] == '#') continue;
+        // "1 phase" / "3 phase" arrive as two fields
+        if (args.size() == 14 && args.back() == "phase") {
+            args[12] += " phase";
+            args.pop_back();
+        }
+        if (args.size() != 13) throw invalid_argument(path + ":" + to_string(number) + ": expected a name and 12 arguments");
+        pairs.push_back(parse_port_pair(vector<string>(args.begin() + 1, args.end()), args[0]));
+    }
+    if (pairs.empty()) throw invalid_argument(path + " has no port pairs");
+    return pairs;
+}
+
+// "16,16,10": the most the charger may draw on L1, L2 and L3
+std::array<double, 3> parse_phase_limits(const string& text) {
+    std::array<double, 3> limits;
+    istringstream stream(text);
+    string part;
+    for (double& limit : limits) {
+        if (!getline(stream, part, ',')) throw invalid_argument("Expected three phase limits in " + text);
+        limit = stod(part);
+    }
+    if (getline(stream, part, ',')) throw invalid_argument("Expected three phase limits in " + text);
+    return limits;
+}
+
 int main(int argc, char* argv[]) {
     try {
-        if (argc != 13) {
-            cerr << "Usage: " << argv[0] << " <read_port> <read_baud_rate> <write_port> <write_baud_rate> "
+        // Options start with "--" and may appear anywhere, the rest is positional
+        vector<string> args;
+        ReaderWriterOptions options;
+        string pairs_path;
+        string metrics_address;
+        int threads = 0;
+        LogLevel log_level = LogLevel::info;
+        unsigned log_rate = 10;
+        realtime::Settings realtime_settings;
+        for (int i = 1; i < argc; ++i) {
+            string arg = argv[i];
+            if (arg == "--passthrough") options.passthrough = true;
+            else if (arg.compare(0, 10, "--capture=") == 0) options.capture_path = arg.substr(10);
+            else if (arg.compare(0, 6, "--shm=") == 0) options.shm_name = arg.substr(6);
+            else if (arg == "--shm-checksum") options.shm_checksum = true;
+            else if (arg.compare(0, 10, "--history=") == 0) options.history_path = arg.substr(10);
+            else if (arg.compare(0, 15, "--history-days=") == 0) options.history_sizes.raw_days = stoul(arg.substr(15));
+            else if (arg.compare(0, 22, "--history-minute-days=") == 0) options.history_sizes.minute_days = stoul(arg.substr(22));
+            else if (arg.compare(0, 23, "--history-quarter-days=") == 0) options.history_sizes.quarter_days = stoul(arg.substr(23));
+            else if (arg == "--low-latency") options.tuning.low_latency = true;
+            else if (arg.compare(0, 16, "--latency-timer=") == 0) options.tuning.latency_timer_ms = stoul(arg.substr(16));
+            else if (arg.compare(0, 14, "--read-wakeup=") == 0) options.tuning.read_wakeup = serial_tuning::parse_wakeup(arg.substr(14));
+            else if (arg == "--realtime") realtime_settings.lock_memory = true;
+            else if (arg.compare(0, 6, "--cpu=") == 0) realtime_settings.cpus = realtime::parse_cpus(arg.substr(6));
+            else if (arg.compare(0, 7, "--fifo=") == 0) realtime_settings.fifo_priority = realtime::parse_fifo_priority(arg.substr(7));
+            else if (arg.compare(0, 8, "--pairs=") == 0) pairs_path = arg.substr(8);
+            else if (arg.compare(0, 10, "--threads=") == 0) threads = stoi(arg.substr(10));
+            else if (arg.compare(0, 10, "--metrics=") == 0) metrics_address = arg.substr(10);
+            else if (arg == "--headless") options.headless = true;
+            else if (arg.compare(0, 12, "--log-level=") == 0) log_level = parse_log_level(arg.substr(12));
+            else if (arg.compare(0, 11, "--log-rate=") == 0) log_rate = stoul(arg.substr(11));
+            else if (arg.compare(0, 5, "--kp=") == 0) options.controller.kp = stod(arg.substr(5));
+            else if (arg.compare(0, 5, "--ki=") == 0) options.controller.ki = stod(arg.substr(5));
+            else if (arg.compare(0, 17, "--control-period=") == 0) options.controller.period = stod(arg.substr(17));
+            else if (arg.compare(0, 15, "--phase-limits=") == 0) options.controller.limits = parse_phase_limits(arg.substr(15));
+            else if (arg.compare(0, 2, "--") == 0) throw invalid_argument("Unknown option " + arg);
+            else args.push_back(arg);
+        }
+        if (options.tuning.latency_timer_ms < 1 || options.tuning.latency_timer_ms > 255) {
+            throw invalid_argument("The latency timer must be 1 to 255 ms");
+        }
+
+        vector<PortPairConfig> pairs;
+        if (!pairs_path.empty() && args.empty()) {
+            pairs = read_port_pairs(pairs_path);
+        } else if (pairs_path.empty() && args.size() == 12) {
+            pairs.push_back(parse_port_pair(args));
+        } else {
+            cerr << "Usage: " << argv[0] << " [options] <read_port> <read_baud_rate> <write_port> <write_baud_rate> "
                  << "<read_parity> <read_stop_bits> <read_data_bits> <write_parity> <write_stop_bits> <write_data_bits> "
-                 << "<current_limit> <car_charging_phases>\n";			
+                 << "<current_limit> <car_charging_phases>\n"
+                 << "       " << argv[0] << " [options] --pairs=<file>\n"
+                 << "Options: --passthrough --capture=<file> --shm=<name> --shm-checksum --history=<file> --history-days=<n> --history-minute-days=<n> --history-quarter-days=<n> --threads=<n> --metrics=<host:port>|unix:<path>\n"
+                 << "         --headless --log-level=debug|info|warning|error --log-rate=<records per second per event>\n"
+                 << "         --kp=<A/A> --ki=<A/A/s> --control-period=<s> --phase-limits=<L1>,<L2>,<L3>\n"
+                 << "         --low-latency --latency-timer=<ms> --read-wakeup=any|line\n"
+                 << "         --realtime --cpu=<n>[,<n>...] --fifo=<priority>\n";
             return 1;
         }
+        if (threads <= 0) {
+            threads = static_cast<int>(min<size_t>(pairs.size(), max(1u, thread::hardware_concurrency())));
+        }
+
+        // Headless: JSON lines on stdout for the journal. Otherwise the
+        // dashboard owns stdout and the log goes to stderr.
+        AsyncLogger::instance().start(log_level, options.headless ? stdout : stderr, stdout, log_rate);
 
+        // Open every pair on its own thread: opening and configuring a port
+        // can take a while and one missing adapter should not hold up the rest
         io_service io;
-        string read_port = argv[1];
-        int read_baud_rate = stoi(argv[2]);
-        string write_port = argv[3];
-        int write_baud_rate = stoi(argv[4]);
-        string read_parity = argv[5];
-        string read_stop_bits = argv[6];
-        int read_data_bits = stoi(argv[7]);
-        string write_parity = argv[8];
-        string write_stop_bits = argv[9];
-        int write_data_bits = stoi(argv[10]);
-        double current_limit = stod(argv[11]);
-		string car_charging_phases = argv[12];
-        bool car_charging_three_phases = false;
-		if (car_charging_phases == "1 phase") car_charging_three_phases = false;
-		else if (car_charging_phases == "3 phase") car_charging_three_phases = true;
-		else throw invalid_argument("Invalid car_charging_phases option");
-        
-        SerialReaderWriter serialReaderWriter(io, read_port, read_baud_rate, write_port, write_baud_rate,
-                                              read_parity, read_stop_bits, read_data_bits,
-                                              write_parity, write_stop_bits, write_data_bits,
-                                              current_limit, car_charging_three_phases);
-
-        signal(SIGINT, [](int) {
-            cout << "Stopping..." << endl;
-            exit(0);
+
+        // A signal only stops the io_service; main then returns normally, so
+        // the readers flush their capture, put the port tuning back and
+        // remove their shared-memory snapshot
+        boost::asio::signal_set signals(io, SIGINT, SIGTERM);
+        signals.async_wait([&io](const boost::system::error_code& error, int signal) {
+            if (error) return;
+            // Through the logger: with --headless stdout is its JSON stream
+            AsyncLogger::instance().log(LogLevel::info, "stopping").field("signal", signal == SIGINT ? "SIGINT" : "SIGTERM");
+            io.stop();
         });
 
-        serialReaderWriter.run();
+        vector<unique_ptr<SerialReaderWriter>> readers(pairs.size());
+        vector<exception_ptr> errors(pairs.size());
+        vector<thread> openers;
+        for (size_t i = 0; i < pairs.size(); ++i) {
+            openers.emplace_back([&, i] {
+                const PortPairConfig& pair = pairs[i];
+                ReaderWriterOptions pair_options = options;
+                pair_options.name = pair.name;
+                pair_options.clear_screen = pairs.size() == 1;
+                if (pairs.size() > 1 && !options.capture_path.empty()) pair_options.capture_path += "." + pair.name;
+                if (pairs.size() > 1 && !options.shm_name.empty()) pair_options.shm_name += "." + pair.name;
+                if (pairs.size() > 1 && !options.history_path.empty()) pair_options.history_path += "." + pair.name;
+                try {
+                    readers[i].reset(new SerialReaderWriter(io, pair.read_port, pair.read_baud_rate, pair.write_port, pair.write_baud_rate,
+                                                            pair.read_parity, pair.read_stop_bits, pair.read_data_bits,
+                                                            pair.write_parity, pair.write_stop_bits, pair.write_data_bits,
+                                                            pair.current_limit, pair.car_charging_three_phases, pair_options));
+                } catch (...) {
+                    errors[i] = current_exception();
+                }
+            });
+        }
+        for (thread& opener : openers) opener.join();
+        for (size_t i = 0; i < pairs.size(); ++i) {
+            if (!errors[i]) continue;
+            if (!pairs[i].name.empty()) cerr << "Port pair " << pairs[i].name << ": ";
+            rethrow_exception(errors[i]);
+        }
+
+        shared_ptr<void> metrics_server;
+        if (!metrics_address.empty()) metrics_server = start_metrics_server(io, metrics_address);
+
+        // Everything the hot path needs exists by now. The logger thread was
+        // started before and keeps its own CPUs and scheduling.
+        if (realtime_settings.lock_memory) {
+            realtime::lock_memory();
+            AsyncLogger::instance().lock_ring();
+            for (auto& reader : readers) {
+                reader->lock_buffers();
+                reader->unlock_history();
+            }
+        }
+        realtime::apply_to_thread(realtime_settings);
+
+        vector<thread> workers;
+        try {
+            for (int i = 1; i < threads; ++i) {
+                workers.emplace_back([&io, &realtime_settings] {
+                    try {
+                        realtime::apply_to_thread(realtime_settings);
+                        if (realtime_settings.lock_memory) realtime::prefault_stack();
+                        io.run();
+                    } catch (const exception& e) {
+                        cerr << "Exception: " << e.what() << endl;
+                        io.stop();
+                    }
+                });
+            }
+            io.run();
+        } catch (...) {
+            // Destroying a joinable thread would terminate the process
+            // before the readers could clean up
+            io.stop();
+            for (thread& worker : workers) worker.join();
+            throw;
+        }
+        for (thread& worker : workers) worker.join();
     }
     catch (const exception& e) {
         cerr << "Exception: " << e.what() << endl;
     }
 
+    // Nothing logs any more: the io threads are gone and the readers destroyed
+    AsyncLogger::instance().stop();
     return 0;
 }
@@ -0,0 +1,344 @@
+#pragma once
+
+// P1 telegram data model: the OBIS lines laadpaal understands, described
+// once at compile time, and a fixed block of values indexed by field.
+//
+// Every field is one row of P1_FIELDS: name, OBIS reference, type, unit and
+// the DSMR format (digits and decimals for numbers, capacity for text). The
+// rows are in the order in which telegrams are rebuilt. Parsing, encoding
+// and the dashboard all walk this table; nothing else lists the fields.
+//
+// The table covers DSMR 2.2, 4 and 5 meters and up to four M-Bus devices
+// (gas, water) on channels 0-1 to 0-4, in both the DSMR 4/5 form
+//     0-1:24.2.1(230101120000W)(01234.567*m3)
+// and the DSMR 2.2 form, where the reading is on the next line
+//     0-1:24.3.0(230101120000)(08)(60)(1)(0-1:24.2.1)(m3)
+//     (01234.567)
+
+#include <algorithm>
+#include <array>
+#include <charconv>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+#include <system_error>
+
+// OBIS reference A-B:C.D.E packed into one integer, so lines can be matched
+// against the field table without building strings.
+constexpr uint64_t obis_code(unsigned a, unsigned b, unsigned c, unsigned d, unsigned e) {
+    return (uint64_t(a) << 32) | (uint64_t(b) << 24) | (uint64_t(c) << 16) | (uint64_t(d) << 8) | uint64_t(e);
+}
+
+struct ObisLine {
+    uint64_t code = 0;
+    std::string_view value;  // Everything between the first '(' and the last ')'
+    std::string_view number; // First group up to the '*' unit separator
+    std::string_view unit;   // Unit after '*' in the first group, empty if none
+};
+
+// Parses one "A-B:C.D.E(value*unit)" line. Returns false for anything else,
+// including lines cut off at the end of the buffer.
+inline bool parse_obis_line(std::string_view line, ObisLine& out) {
+    unsigned parts[5] = {0, 0, 0, 0, 0};
+    const char separators[5] = {'-', ':', '.', '.', '('};
+    size_t pos = 0;
+    for (int i = 0; i < 5; ++i) {
+        const char* first = line.data() + pos;
+        auto result = std::from_chars(first, line.data() + line.size(), parts[i]);
+        if (result.ec != std::errc() || result.ptr == first || parts[i] > 255) return false;
+        pos = result.ptr - line.data();
+        if (pos >= line.size() || line[pos] != separators[i]) return false;
+        ++pos;
+    }
+
+    size_t close = line.rfind(')');
+    if (close == std::string_view::npos || close < pos) return false;
+    out.code = obis_code(parts[0], parts[1], parts[2], parts[3], parts[4]);
+    out.value = line.substr(pos, close - pos);
+
+    std::string_view group = out.value.substr(0, out.value.find(')'));
+    size_t star = group.find('*');
+    out.number = group.substr(0, star);
+    out.unit = star == std::string_view::npos ? std::string_view() : group.substr(star + 1);
+    return true;
+}
+
+// Walks the buffer once, handing the "/" identification line to on_header
+// and every well-formed OBIS line to on_line. Lines starting with '(' belong
+// to the line before them (DSMR 2.2 M-Bus readings) and are handed over
+// together with it, line break included.
+template <typename HeaderHandler, typename LineHandler>
+void tokenize_telegram(std::string_view data, HeaderHandler&& on_header, LineHandler&& on_line) {
+    ObisLine line;
+    while (!data.empty()) {
+        size_t eol = data.find('\n');
+        while (eol != std::string_view::npos && eol + 1 < data.size() && data[eol + 1] == '(') {
+            eol = data.find('\n', eol + 1);
+        }
+        std::string_view raw = data.substr(0, eol);
+        data = eol == std::string_view::npos ? std::string_view() : data.substr(eol + 1);
+
+        if (!raw.empty() && raw.back() == '\r') raw.remove_suffix(1);
+        if (raw.empty()) continue;
+        if (raw.front() == '/') {
+            // Only a terminated line carries the complete identification; in a
+            // telegram without data lines the end marker follows it directly
+            if (eol != std::string_view::npos) on_header(raw.substr(1, raw.find('!') - 1));
+        } else if (parse_obis_line(raw, line)) {
+            on_line(line);
+        }
+    }
+}
+
+template <typename T>
+bool parse_number(std::string_view text, T& value) {
+    auto result = std::from_chars(text.data(), text.data() + text.size(), value);
+    return result.ec == std::errc() && result.ptr == text.data() + text.size() && !text.empty();
+}
+
+enum class ObisType : uint8_t {
+    number,       // "(001234.567*kWh)", digits and decimals as in DSMR "F9(3,3)"
+    integer,      // "(00004)", zero padded to digits
+    text,         // First group as is: "(230101120000W)"
+    whole_text,   // All groups as is: the power failure log
+    mbus,         // "(timestamp)(reading*unit)": timestamp as text plus the reading
+    mbus_legacy,  // DSMR 2.2 "(timestamp)(..)(unit)\r\n(reading)": all as text plus the reading
+};
+
+#define P1_MBUS_FIELDS(X, n) \
+    X(mbus##n##_type,           0, n, 24, 1, 0,   integer,     nullptr, 3, 0, 0)   \
+    X(mbus##n##_equipment_id,   0, n, 96, 1, 0,   text,        nullptr, 0, 0, 96)  \
+    X(mbus##n##_reading,        0, n, 24, 2, 1,   mbus,        "m3",    8, 3, 16)  \
+    X(mbus##n##_legacy_reading, 0, n, 24, 3, 0,   mbus_legacy, nullptr, 8, 3, 96)
+
+// name, OBIS reference, type, unit, digits, decimals, text capacity
+#define P1_FIELDS(X) \
+    X(version,                  1, 3, 0, 2, 8,    integer,     nullptr, 2, 0, 0)    \
+    X(timestamp,                0, 0, 1, 0, 0,    text,        nullptr, 0, 0, 16)   \
+    X(equipment_id,             0, 0, 96, 1, 1,   text,        nullptr, 0, 0, 96)   \
+    X(energy_delivered_tariff1, 1, 0, 1, 8, 1,    number,      "kWh",   9, 3, 0)    \
+    X(energy_delivered_tariff2, 1, 0, 1, 8, 2,    number,      "kWh",   9, 3, 0)    \
+    X(energy_returned_tariff1,  1, 0, 2, 8, 1,    number,      "kWh",   9, 3, 0)    \
+    X(energy_returned_tariff2,  1, 0, 2, 8, 2,    number,      "kWh",   9, 3, 0)    \
+    X(tariff,                   0, 0, 96, 14, 0,  integer,     nullptr, 4, 0, 0)    \
+    X(power_delivered,          1, 0, 1, 7, 0,    number,      "kW",    5, 3, 0)    \
+    X(power_returned,           1, 0, 2, 7, 0,    number,      "kW",    5, 3, 0)    \
+    X(threshold,                0, 0, 17, 0, 0,   number,      "kW",    4, 1, 0)    \
+    X(breaker_state,            0, 0, 96, 3, 10,  integer,     nullptr, 1, 0, 0)    \
+    X(power_failures,           0, 0, 96, 7, 21,  integer,     nullptr, 5, 0, 0)    \
+    X(long_power_failures,      0, 0, 96, 7, 9,   integer,     nullptr, 5, 0, 0)    \
+    X(power_failure_log,        1, 0, 99, 97, 0,  whole_text,  nullptr, 0, 0, 384)  \
+    X(voltage_sags_l1,          1, 0, 32, 32, 0,  integer,     nullptr, 5, 0, 0)    \
+    X(voltage_sags_l2,          1, 0, 52, 32, 0,  integer,     nullptr, 5, 0, 0)    \
+    X(voltage_sags_l3,          1, 0, 72, 32, 0,  integer,     nullptr, 5, 0, 0)    \
+    X(voltage_swells_l1,        1, 0, 32, 36, 0,  integer,     nullptr, 5, 0, 0)    \
+    X(voltage_swells_l2,        1, 0, 52, 36, 0,  integer,     nullptr, 5, 0, 0)    \
+    X(voltage_swells_l3,        1, 0, 72, 36, 0,  integer,     nullptr, 5, 0, 0)    \
+    X(message_code,             0, 0, 96, 13, 1,  text,        nullptr, 0, 0, 16)   \
+    X(message_text,             0, 0, 96, 13, 0,  text,        nullptr, 0, 0, 2048) \
+    X(voltage_l1,               1, 0, 32, 7, 0,   number,      "V",     4, 1, 0)    \
+    X(voltage_l2,               1, 0, 52, 7, 0,   number,      "V",     4, 1, 0)    \
+    X(voltage_l3,               1, 0, 72, 7, 0,   number,      "V",     4, 1, 0)    \
+    X(current_l1,               1, 0, 31, 7, 0,   number,      "A",     3, 0, 0)    \
+    X(current_l2,               1, 0, 51, 7, 0,   number,      "A",     3, 0, 0)    \
+    X(current_l3,               1, 0, 71, 7, 0,   number,      "A",     3, 0, 0)    \
+    X(power_delivered_l1,       1, 0, 21, 7, 0,   number,      "kW",    5, 3, 0)    \
+    X(power_delivered_l2,       1, 0, 41, 7, 0,   number,      "kW",    5, 3, 0)    \
+    X(power_delivered_l3,       1, 0, 61, 7, 0,   number,      "kW",    5, 3, 0)    \
+    X(power_returned_l1,        1, 0, 22, 7, 0,   number,      "kW",    5, 3, 0)    \
+    X(power_returned_l2,        1, 0, 42, 7, 0,   number,      "kW",    5, 3, 0)    \
+    X(power_returned_l3,        1, 0, 62, 7, 0,   number,      "kW",    5, 3, 0)    \
+    P1_MBUS_FIELDS(X, 1) \
+    P1_MBUS_FIELDS(X, 2) \
+    P1_MBUS_FIELDS(X, 3) \
+    P1_MBUS_FIELDS(X, 4)
+
+enum class Obis : uint8_t {
+#define P1_ENUM(name, a, b, c, d, e, type, unit, digits, decimals, capacity) name,
+    P1_FIELDS(P1_ENUM)
+#undef P1_ENUM
+    count
+};
+
+constexpr size_t obis_field_count = static_cast<size_t>(Obis::count);
+
+struct ObisSchemaEntry {
+    uint64_t code;
+    const char* reference;  // "1-0:1.8.1", written in front of the value
+    ObisType type;
+    const char* unit;       // Required unit of the reading, nullptr for none
+    uint8_t digits;
+    uint8_t decimals;
+    uint16_t capacity;      // Bytes of text kept, longer values are dropped
+    const char* name;
+};
+
+constexpr ObisSchemaEntry obis_schema[] = {
+#define P1_ENTRY(name, a, b, c, d, e, type, unit, digits, decimals, capacity) \
+    {obis_code(a, b, c, d, e), #a "-" #b ":" #c "." #d "." #e, ObisType::type, unit, digits, decimals, capacity, #name},
+    P1_FIELDS(P1_ENTRY)
+#undef P1_ENTRY
+};
+
+static_assert(sizeof(obis_schema) / sizeof(obis_schema[0]) == obis_field_count, "One schema row per field");
+static_assert(obis_field_count <= 64, "The seen bits are one uint64_t");
+
+constexpr const ObisSchemaEntry& schema_of(Obis id) {
+    return obis_schema[static_cast<size_t>(id)];
+}
+
+namespace obis_detail {
+
+// Field indexes ordered by OBIS code, for a binary search per parsed line
+constexpr std::array<uint8_t, obis_field_count> make_code_order() {
+    std::array<uint8_t, obis_field_count> order{};
+    for (size_t i = 0; i < obis_field_count; ++i) {
+        size_t j = i;
+        for (; j > 0 && obis_schema[order[j - 1]].code > obis_schema[i].code; --j) order[j] = order[j - 1];
+        order[j] = static_cast<uint8_t>(i);
+    }
+    return order;
+}
+
+// Start of each field's text in the arena, the last entry is the arena size
+constexpr std::array<size_t, obis_field_count + 1> make_text_offsets() {
+    std::array<size_t, obis_field_count + 1> offsets{};
+    for (size_t i = 0; i < obis_field_count; ++i) offsets[i + 1] = offsets[i] + obis_schema[i].capacity;
+    return offsets;
+}
+
+constexpr std::array<uint8_t, obis_field_count> code_order = make_code_order();
+constexpr std::array<size_t, obis_field_count + 1> text_offsets = make_text_offsets();
+
+constexpr bool codes_unique() {
+    for (size_t i = 1; i < obis_field_count; ++i) {
+        if (obis_schema[code_order[i - 1]].code == obis_schema[code_order[i]].code) return false;
+    }
+    return true;
+}
+
+static_assert(codes_unique(), "Every OBIS code appears once in the schema");
+
+} // namespace obis_detail
+
+// Returns Obis::count for codes that are not in the schema
+inline Obis find_obis(uint64_t code) {
+    const uint8_t* first = obis_detail::code_order.data();
+    const uint8_t* last = first + obis_field_count;
+    const uint8_t* found = std::lower_bound(first, last, code,
+        [](uint8_t index, uint64_t c) { return obis_schema[index].code < c; });
+    return found != last && obis_schema[*found].code == code ? static_cast<Obis>(*found) : Obis::count;
+}
+
+// The latest value of every field. Numbers and integers live in one array
+// of doubles, text in a fixed arena sized by the schema, so storing a
+// telegram never allocates. Each field records whether it has been seen and
+// the telegram that last set it.
+class ObisValues {
+public:
+    static constexpr size_t header_capacity = 64;
+
+    // Call once per telegram, before its lines are stored
+    void begin_telegram() {
+        ++telegram_;
+    }
+
+    void set_header(std::string_view header) {
+        header_length_ = std::min(header.size(), header_capacity);
+        std::memcpy(header_.data(), header.data(), header_length_);
+    }
+
+    // Returns false for lines that are not in the schema or do not match it
+    bool store(const ObisLine& line) {
+        Obis id = find_obis(line.code);
+        if (id == Obis::count) return false;
+        const ObisSchemaEntry& entry = schema_of(id);
+        size_t index = static_cast<size_t>(id);
+
+        // Parsed into locals first: a partly valid number must not
+        // overwrite the previous reading
+        double number = numbers_[index];
+        switch (entry.type) {
+        case ObisType::number:
+            if (entry.unit && line.unit != entry.unit) return false;
+            if (!parse_number(line.number, number)) return false;
+            break;
+        case ObisType::integer: {
+            long long value;
+            if (!line.unit.empty() || !parse_number(line.number, value)) return false;
+            number = static_cast<double>(value);
+            break;
+        }
+        case ObisType::text:
+            if (!set_text(index, line.number)) return false;
+            break;
+        case ObisType::whole_text:
+            if (!set_text(index, line.value)) return false;
+            break;
+        case ObisType::mbus: {
+            std::string_view reading = last_group(line.value);
+            size_t star = reading.find('*');
+            std::string_view unit = star == std::string_view::npos ? std::string_view() : reading.substr(star + 1);
+            if ((entry.unit && unit != entry.unit) || !parse_number(reading.substr(0, star), number)) return false;
+            if (!set_text(index, line.number)) return false;
+            break;
+        }
+        case ObisType::mbus_legacy:
+            if (!parse_number(last_group(line.value), number) || !set_text(index, line.value)) return false;
+            break;
+        }
+        numbers_[index] = number;
+        seen_ |= uint64_t(1) << index;
+        updated_in_[index] = telegram_;
+        return true;
+    }
+
+    bool seen(Obis id) const {
+        return seen_ & (uint64_t(1) << static_cast<size_t>(id));
+    }
+
+    // Seen, and set by the most recent telegram
+    bool fresh(Obis id) const {
+        return seen(id) && updated_in_[static_cast<size_t>(id)] == telegram_;
+    }
+
+    // 0 for fields that have not been seen
+    double number(Obis id) const {
+        return numbers_[static_cast<size_t>(id)];
+    }
+
+    std::string_view text(Obis id) const {
+        size_t index = static_cast<size_t>(id);
+        return std::string_view(arena_.data() + obis_detail::text_offsets[index], text_lengths_[index]);
+    }
+
+    std::string_view header() const {
+        return std::string_view(header_.data(), header_length_);
+    }
+
+    uint32_t telegrams() const {
+        return telegram_;
+    }
+
+private:
+    static std::string_view last_group(std::string_view value) {
+        size_t open = value.rfind('(');
+        return open == std::string_view::npos ? value : value.substr(open + 1);
+    }
+
+    bool set_text(size_t index, std::string_view text) {
+        if (text.size() > obis_schema[index].capacity) return false;
+        std::memcpy(arena_.data() + obis_detail::text_offsets[index], text.data(), text.size());
+        text_lengths_[index] = static_cast<uint16_t>(text.size());
+        return true;
+    }
+
+    std::array<double, obis_field_count> numbers_{};
+    uint64_t seen_ = 0;
+    uint32_t telegram_ = 0;
+    std::array<uint32_t, obis_field_count> updated_in_{};
+    std::array<uint16_t, obis_field_count> text_lengths_{};
+    size_t header_length_ = 0;
+    std::array<char, header_capacity> header_{};
+    std::array<char, obis_detail::text_offsets[obis_field_count]> arena_{};
+};
@@ -0,0 +1,125 @@
+#pragma once
+
+// Raw serial captures, as written by `laadpaal --capture=<file>` and played
+// back by p1replay.
+//
+// Layout: an 8 byte header ("P1CAP", version, two reserved bytes) followed by
+// one record per read completion:
+//     varint  microseconds since the previous record (first: since start)
+//     varint  number of bytes
+//     bytes   exactly as returned by the serial port
+// A telegram at 115200 baud costs only a few bytes of overhead per read.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace p1_capture {
+
+const char magic[5] = {'P', '1', 'C', 'A', 'P'};
+const unsigned char version = 1;
+
+class Writer {
+public:
+    explicit Writer(const std::string& path)
+        : file_(std::fopen(path.c_str(), "wb")), previous_(std::chrono::steady_clock::now()) {
+        if (!file_) throw std::runtime_error("Cannot create capture file " + path);
+        std::setvbuf(file_, nullptr, _IOFBF, 64 * 1024);
+        const unsigned char header[8] = {'P', '1', 'C', 'A', 'P', version, 0, 0};
+        std::fwrite(header, 1, sizeof(header), file_);
+    }
+
+    ~Writer() {
+        std::fclose(file_);
+    }
+
+    Writer(const Writer&) = delete;
+    Writer& operator=(const Writer&) = delete;
+
+    void write(const char* data, size_t length,
+               std::chrono::steady_clock::time_point when = std::chrono::steady_clock::now()) {
+        auto delta = std::chrono::duration_cast<std::chrono::microseconds>(when - previous_).count();
+        previous_ = when;
+        put_varint(delta < 0 ? 0 : static_cast<uint64_t>(delta));
+        put_varint(length);
+        std::fwrite(data, 1, length, file_);
+    }
+
+    void flush() {
+        std::fflush(file_);
+    }
+
+private:
+    void put_varint(uint64_t value) {
+        unsigned char bytes[10];
+        size_t count = 0;
+        do {
+            bytes[count] = static_cast<unsigned char>(value & 0x7F);
+            value >>= 7;
+            if (value) bytes[count] |= 0x80;
+            ++count;
+        } while (value);
+        std::fwrite(bytes, 1, count, file_);
+    }
+
+    std::FILE* file_;
+    std::chrono::steady_clock::time_point previous_;
+};
+
+struct Record {
+    uint64_t delta_us = 0;
+    std::vector<char> data;
+};
+
+class Reader {
+public:
+    explicit Reader(const std::string& path) : file_(std::fopen(path.c_str(), "rb")) {
+        if (!file_) throw std::runtime_error("Cannot open capture file " + path);
+        unsigned char header[8];
+        if (std::fread(header, 1, sizeof(header), file_) != sizeof(header) ||
+            !std::equal(magic, magic + sizeof(magic), header) || header[5] != version) {
+            std::fclose(file_);
+            throw std::runtime_error(path + " is not a P1 capture file");
+        }
+    }
+
+    ~Reader() {
+        std::fclose(file_);
+    }
+
+    Reader(const Reader&) = delete;
+    Reader& operator=(const Reader&) = delete;
+
+    // Returns false at the end of the file. A record cut off by a crash
+    // while capturing counts as the end.
+    bool next(Record& record) {
+        uint64_t length;
+        if (!get_varint(record.delta_us) || !get_varint(length)) return false;
+        record.data.resize(length);
+        return std::fread(record.data.data(), 1, length, file_) == length;
+    }
+
+    void rewind() {
+        std::fseek(file_, 8, SEEK_SET);
+    }
+
+private:
+    bool get_varint(uint64_t& value) {
+        value = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            int byte = std::fgetc(file_);
+            if (byte == EOF) return false;
+            value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+            if (!(byte & 0x80)) return true;
+        }
+        return false;
+    }
+
+    std::FILE* file_;
+};
+
+} // namespace p1_capture
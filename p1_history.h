@@ -0,0 +1,537 @@
+#pragma once
+
+// Per-telegram history of every numeric OBIS field in a memory-mapped file,
+// written by `laadpaal --history=<file>` and queried with p1history.
+//
+// The file has a fixed size, set when it is created, and three rings:
+//   raw      every telegram, in blocks of up to block_rows rows
+//   minute   one aggregate row per minute
+//   quarter  one aggregate row per 15 minutes (the billing interval)
+//
+// Within a raw block every field is a column. Gauges (power, current,
+// voltage) are float columns. Counters (the kWh registers, M-Bus readings
+// and the integer fields) are stored as fixed-point integers: a base value
+// per block, then per row a varint bit mask of the counters that changed
+// followed by their zigzag varint deltas. A row where only the active
+// tariff register moved costs 3 or 4 bytes of counters.
+//
+// Appending touches one raw row and the current row of each aggregate ring,
+// all in the mapping, so it is O(1) and never allocates. Rows are
+// published by a release store of the row count. A restart carries on in a
+// new block, and the current minute and quarter rows are updated in place,
+// so nothing needs rebuilding after a crash.
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+#include <string>
+
+#include "obis_schema.h"
+
+namespace p1_history {
+
+enum class ColumnKind : uint8_t { none, gauge, counter };
+
+namespace detail {
+
+constexpr bool same_text(const char* a, const char* b) {
+    if (!a || !b) return a == b;
+    while (*a && *a == *b) ++a, ++b;
+    return *a == *b;
+}
+
+constexpr ColumnKind column_kind(const ObisSchemaEntry& entry) {
+    switch (entry.type) {
+    case ObisType::number: return same_text(entry.unit, "kWh") ? ColumnKind::counter : ColumnKind::gauge;
+    case ObisType::integer:
+    case ObisType::mbus:
+    case ObisType::mbus_legacy: return ColumnKind::counter;
+    default: return ColumnKind::none;
+    }
+}
+
+constexpr size_t count_columns(ColumnKind kind) {
+    size_t count = 0;
+    for (const ObisSchemaEntry& entry : obis_schema) count += column_kind(entry) == kind;
+    return count;
+}
+
+} // namespace detail
+
+constexpr size_t gauge_count = detail::count_columns(ColumnKind::gauge);
+constexpr size_t counter_count = detail::count_columns(ColumnKind::counter);
+static_assert(counter_count <= 64, "The changed counters of a row are one 64 bit mask");
+
+template <size_t N>
+constexpr std::array<Obis, N> columns_of(ColumnKind kind) {
+    std::array<Obis, N> columns{};
+    size_t next = 0;
+    for (size_t i = 0; i < obis_field_count; ++i) {
+        if (detail::column_kind(obis_schema[i]) == kind) columns[next++] = static_cast<Obis>(i);
+    }
+    return columns;
+}
+
+// Field of each column
+constexpr std::array<Obis, gauge_count> gauge_columns = columns_of<gauge_count>(ColumnKind::gauge);
+constexpr std::array<Obis, counter_count> counter_columns = columns_of<counter_count>(ColumnKind::counter);
+
+// Counters are kept in units of their last decimal: Wh, litres, counts
+constexpr double counter_scale(Obis id) {
+    double scale = 1;
+    for (int i = 0; i < schema_of(id).decimals; ++i) scale *= 10;
+    return scale;
+}
+
+const char magic[8] = {'P', '1', 'H', 'I', 'S', 'T', 0, 0};
+const uint32_t version = 1;
+const uint32_t block_rows = 1024;
+const uint32_t varint_capacity = 8192;   // Counter bytes per block; a block closes early when full
+const uint64_t minute_ms = 60 * 1000;
+const uint64_t quarter_ms = 15 * minute_ms;
+
+// Days kept in each ring, fixed when the file is created. The defaults come
+// to about 61 MiB: 6 MiB per raw day, 23 MiB of minutes, 20 MiB of quarters
+struct Sizes {
+    unsigned raw_days = 3;
+    unsigned minute_days = 31;     // A month of minutes
+    unsigned quarter_days = 400;   // Over a year of quarters
+};
+
+// Changes with the schema and the column layout; files with another layout
+// are refused rather than misread
+constexpr uint64_t layout_id() {
+    uint64_t hash = 14695981039346656037ull ^ (gauge_count << 8 | counter_count);
+    for (Obis id : gauge_columns) hash = (hash ^ schema_of(id).code) * 1099511628211ull;
+    for (Obis id : counter_columns) hash = (hash ^ (schema_of(id).code << 4 | schema_of(id).decimals)) * 1099511628211ull;
+    return hash;
+}
+
+struct FileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t block_rows;
+    uint64_t layout;
+    uint64_t block_count;
+    uint64_t block_size;
+    uint64_t minute_capacity;
+    uint64_t quarter_capacity;
+    uint64_t blocks_offset;
+    uint64_t minute_offset;
+    uint64_t quarter_offset;
+    uint64_t file_size;
+    std::atomic<uint64_t> blocks_started;  // The current block is (blocks_started - 1) % block_count
+    std::atomic<uint64_t> minute_rows;     // Rows ever written, the last one may still be growing
+    std::atomic<uint64_t> quarter_rows;
+};
+
+struct BlockHeader {
+    std::atomic<uint64_t> generation;  // blocks_started when this block was started
+    std::atomic<uint32_t> rows;
+    uint32_t varint_bytes;
+    int64_t start_ms;
+    int64_t end_ms;
+    uint64_t seen;                     // Fields present in any row, bit per Obis
+    int64_t base[counter_count];       // Counter values of the first row
+};
+
+// Followed in the file by: uint32_t offset_ms[block_rows] (from start_ms),
+// float gauges[gauge_count][block_rows], uint8_t varints[varint_capacity]
+struct BlockLayout {
+    static constexpr uint64_t offsets = (sizeof(BlockHeader) + 63) / 64 * 64;
+    static constexpr uint64_t gauges = offsets + sizeof(uint32_t) * block_rows;
+    static constexpr uint64_t varints = gauges + sizeof(float) * gauge_count * block_rows;
+    static constexpr uint64_t size = (varints + varint_capacity + 63) / 64 * 64;
+};
+
+struct AggregateRow {
+    int64_t start_ms;
+    uint32_t samples;
+    uint32_t reserved;
+    uint64_t seen;
+    double sum[gauge_count];
+    uint32_t count[gauge_count];   // Samples that had the gauge
+    float min[gauge_count];
+    float max[gauge_count];
+    int64_t last[counter_count];   // Counter at the end of the period, fixed point
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free && std::atomic<uint32_t>::is_always_lock_free,
+              "Row counts are shared with readers in other processes");
+
+// Maps the whole file; shared by the writer and the reader
+class HistoryFile {
+public:
+    HistoryFile(const std::string& path, bool writable, const Sizes& sizes = Sizes()) : path_(path) {
+        int fd = open(path.c_str(), writable ? O_RDWR | O_CREAT : O_RDONLY, 0644);
+        if (fd < 0) throw std::runtime_error("Cannot open history " + path + ": " + std::strerror(errno));
+        struct stat status;
+        fstat(fd, &status);
+        if (status.st_size == 0 && writable) {
+            create(fd, sizes);
+        } else {
+            size_ = status.st_size;
+            if (size_ < sizeof(FileHeader)) fail(fd, "is not a history file");
+        }
+        void* memory = mmap(nullptr, size_, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+        if (memory == MAP_FAILED) fail(fd, std::string("cannot be mapped: ") + std::strerror(errno));
+        close(fd);
+        base_ = static_cast<char*>(memory);
+
+        const FileHeader& file = header();
+        if (std::memcmp(file.magic, magic, sizeof(magic)) != 0 || file.version != version) fail(-1, "is not a history file");
+        if (file.layout != layout_id() || file.block_rows != block_rows || file.block_size != BlockLayout::size) {
+            fail(-1, "was written for other OBIS fields; move it aside to start a new one");
+        }
+        if (file.file_size != size_) fail(-1, "has the wrong size");
+    }
+
+    ~HistoryFile() {
+        munmap(base_, size_);
+    }
+
+    HistoryFile(const HistoryFile&) = delete;
+    HistoryFile& operator=(const HistoryFile&) = delete;
+
+    FileHeader& header() const {
+        return *reinterpret_cast<FileHeader*>(base_);
+    }
+
+    BlockHeader& block(uint64_t index) const {
+        return *reinterpret_cast<BlockHeader*>(block_base(index));
+    }
+
+    uint32_t* offsets(uint64_t index) const {
+        return reinterpret_cast<uint32_t*>(block_base(index) + BlockLayout::offsets);
+    }
+
+    float* gauges(uint64_t index, size_t column) const {
+        return reinterpret_cast<float*>(block_base(index) + BlockLayout::gauges) + column * block_rows;
+    }
+
+    uint8_t* varints(uint64_t index) const {
+        return reinterpret_cast<uint8_t*>(block_base(index) + BlockLayout::varints);
+    }
+
+    // Row number ever written, wrapped onto the ring
+    AggregateRow& minute(uint64_t row) const {
+        return reinterpret_cast<AggregateRow*>(base_ + header().minute_offset)[row % header().minute_capacity];
+    }
+
+    AggregateRow& quarter(uint64_t row) const {
+        return reinterpret_cast<AggregateRow*>(base_ + header().quarter_offset)[row % header().quarter_capacity];
+    }
+
+    uint64_t size() const {
+        return size_;
+    }
+
+    // Leaves the file to the page cache under mlockall(): it is written
+    // back by the kernel anyway and would otherwise end up locked in full
+    void unlock() const {
+        munlock(base_, size_);
+    }
+
+private:
+    char* block_base(uint64_t index) const {
+        return base_ + header().blocks_offset + index * BlockLayout::size;
+    }
+
+    // Writes the header with write(2) before mapping, so a crash during
+    // creation leaves a file that is refused instead of a corrupt one
+    void create(int fd, const Sizes& sizes) {
+        if (sizes.minute_days == 0 || sizes.quarter_days == 0) fail(fd, "needs at least one day of minutes and quarters");
+        FileHeader file;
+        std::memset(static_cast<void*>(&file), 0, sizeof(file));
+        std::memcpy(file.magic, magic, sizeof(magic));
+        file.version = version;
+        file.block_rows = block_rows;
+        file.layout = layout_id();
+        // One telegram per second, plus one block for the block being replaced
+        file.block_count = (uint64_t(sizes.raw_days) * 86400 + block_rows - 1) / block_rows + 1;
+        file.block_size = BlockLayout::size;
+        file.minute_capacity = uint64_t(sizes.minute_days) * 86400 * 1000 / minute_ms;
+        file.quarter_capacity = uint64_t(sizes.quarter_days) * 86400 * 1000 / quarter_ms;
+        file.blocks_offset = 4096;
+        file.minute_offset = file.blocks_offset + file.block_count * file.block_size;
+        file.quarter_offset = file.minute_offset + file.minute_capacity * sizeof(AggregateRow);
+        file.file_size = file.quarter_offset + file.quarter_capacity * sizeof(AggregateRow);
+        // Allocate every block now: a full disk must fail here, not as a
+        // SIGBUS while writing through the mapping
+        int error = posix_fallocate(fd, 0, file.file_size);
+        if (error != 0) fail(fd, std::string("cannot be allocated: ") + std::strerror(error));
+        if (pwrite(fd, &file, sizeof(file), 0) != static_cast<ssize_t>(sizeof(file))) {
+            fail(fd, std::string("cannot be written: ") + std::strerror(errno));
+        }
+        size_ = file.file_size;
+    }
+
+    [[noreturn]] void fail(int fd, const std::string& reason) {
+        if (fd >= 0) close(fd);
+        if (base_) munmap(base_, size_);
+        base_ = nullptr;
+        throw std::runtime_error("History " + path_ + " " + reason);
+    }
+
+    std::string path_;
+    char* base_ = nullptr;
+    uint64_t size_ = 0;
+};
+
+class HistoryWriter {
+public:
+    // sizes only apply when the file is created
+    HistoryWriter(const std::string& path, const Sizes& sizes) : file_(path, true, sizes) {
+        const FileHeader& file = file_.header();
+        uint64_t minutes = file.minute_rows.load(std::memory_order_relaxed);
+        uint64_t quarters = file.quarter_rows.load(std::memory_order_relaxed);
+        if (minutes > 0) last_ms_ = std::max(last_ms_, file_.minute(minutes - 1).start_ms);
+        if (quarters > 0) last_ms_ = std::max(last_ms_, file_.quarter(quarters - 1).start_ms);
+    }
+
+    const HistoryFile& file() const {
+        return file_;
+    }
+
+    void append(const ObisValues& values, int64_t time_ms) {
+        uint64_t seen = 0;
+        for (size_t i = 0; i < obis_field_count; ++i) {
+            if (values.seen(static_cast<Obis>(i))) seen |= uint64_t(1) << i;
+        }
+        float gauges[gauge_count];
+        for (size_t g = 0; g < gauge_count; ++g) {
+            gauges[g] = values.seen(gauge_columns[g]) ? static_cast<float>(values.number(gauge_columns[g]))
+                                                      : std::numeric_limits<float>::quiet_NaN();
+        }
+        int64_t counters[counter_count];
+        for (size_t c = 0; c < counter_count; ++c) {
+            counters[c] = std::llround(values.number(counter_columns[c]) * counter_scale(counter_columns[c]));
+        }
+
+        append_raw(seen, gauges, counters, time_ms);
+        // The readers binary search the aggregate rings, so a clock stepped
+        // back (an NTP correction) keeps adding to the latest row instead.
+        // Raw rows keep the real time: a step back starts a new block.
+        time_ms = std::max(time_ms, last_ms_);
+        last_ms_ = time_ms;
+        FileHeader& file = file_.header();
+        aggregate(file.minute_rows, [this](uint64_t row) -> AggregateRow& { return file_.minute(row); },
+                  minute_ms, seen, gauges, counters, time_ms);
+        aggregate(file.quarter_rows, [this](uint64_t row) -> AggregateRow& { return file_.quarter(row); },
+                  quarter_ms, seen, gauges, counters, time_ms);
+    }
+
+private:
+    // Worst case for one row of counters: the mask plus every delta
+    static constexpr size_t max_row_bytes = 10 * (counter_count + 1);
+
+    void append_raw(uint64_t seen, const float* gauges, const int64_t* counters, int64_t time_ms) {
+        FileHeader& file = file_.header();
+        bool new_block = !in_block_;
+        if (!new_block) {
+            BlockHeader& block = file_.block(current_);
+            uint32_t rows = block.rows.load(std::memory_order_relaxed);
+            new_block = rows == block_rows || time_ms < block.end_ms ||
+                        time_ms - block.start_ms > std::numeric_limits<int32_t>::max() ||
+                        varint_capacity - block.varint_bytes < max_row_bytes;
+        }
+        if (new_block) {
+            uint64_t generation = file.blocks_started.load(std::memory_order_relaxed) + 1;
+            current_ = (generation - 1) % file.block_count;
+            BlockHeader& block = file_.block(current_);
+            // Readers skip the block while it is empty or its generation changes
+            block.rows.store(0, std::memory_order_relaxed);
+            block.generation.store(generation, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+            block.varint_bytes = 0;
+            block.start_ms = block.end_ms = time_ms;
+            block.seen = 0;
+            std::memcpy(block.base, counters, sizeof(block.base));
+            std::memcpy(previous_, counters, sizeof(previous_));
+            file.blocks_started.store(generation, std::memory_order_release);
+            in_block_ = true;
+        }
+
+        BlockHeader& block = file_.block(current_);
+        uint32_t row = block.rows.load(std::memory_order_relaxed);
+        file_.offsets(current_)[row] = static_cast<uint32_t>(time_ms - block.start_ms);
+        for (size_t g = 0; g < gauge_count; ++g) file_.gauges(current_, g)[row] = gauges[g];
+
+        uint8_t* out = file_.varints(current_) + block.varint_bytes;
+        uint64_t changed = 0;
+        for (size_t c = 0; c < counter_count; ++c) {
+            if (counters[c] != previous_[c]) changed |= uint64_t(1) << c;
+        }
+        out = put_varint(out, changed);
+        for (size_t c = 0; c < counter_count; ++c) {
+            if (!(changed & (uint64_t(1) << c))) continue;
+            int64_t delta = counters[c] - previous_[c];
+            out = put_varint(out, (static_cast<uint64_t>(delta) << 1) ^ static_cast<uint64_t>(delta >> 63));
+            previous_[c] = counters[c];
+        }
+        block.varint_bytes = static_cast<uint32_t>(out - file_.varints(current_));
+        block.end_ms = time_ms;
+        block.seen |= seen;
+        block.rows.store(row + 1, std::memory_order_release);
+    }
+
+    // The row of the current period is updated in place; a new period, or a
+    // restart within the same one, carries on in the right row
+    template <typename RowAt>
+    void aggregate(std::atomic<uint64_t>& written, RowAt&& row_at, uint64_t period_ms,
+                   uint64_t seen, const float* gauges, const int64_t* counters, int64_t time_ms) {
+        int64_t start = time_ms - ((time_ms % int64_t(period_ms)) + int64_t(period_ms)) % int64_t(period_ms);
+        uint64_t rows = written.load(std::memory_order_relaxed);
+        if (rows == 0 || row_at(rows - 1).start_ms != start) {
+            AggregateRow& row = row_at(rows);
+            std::memset(static_cast<void*>(&row), 0, sizeof(row));
+            row.start_ms = start;
+            for (size_t g = 0; g < gauge_count; ++g) {
+                row.min[g] = std::numeric_limits<float>::infinity();
+                row.max[g] = -std::numeric_limits<float>::infinity();
+            }
+            written.store(++rows, std::memory_order_release);
+        }
+        AggregateRow& row = row_at(rows - 1);
+        ++row.samples;
+        row.seen |= seen;
+        for (size_t g = 0; g < gauge_count; ++g) {
+            if (std::isnan(gauges[g])) continue;
+            row.sum[g] += gauges[g];
+            ++row.count[g];
+            row.min[g] = std::min(row.min[g], gauges[g]);
+            row.max[g] = std::max(row.max[g], gauges[g]);
+        }
+        std::memcpy(row.last, counters, sizeof(row.last));
+    }
+
+    static uint8_t* put_varint(uint8_t* out, uint64_t value) {
+        while (value >= 0x80) {
+            *out++ = static_cast<uint8_t>(value | 0x80);
+            value >>= 7;
+        }
+        *out++ = static_cast<uint8_t>(value);
+        return out;
+    }
+
+    HistoryFile file_;
+    int64_t last_ms_ = std::numeric_limits<int64_t>::min();  // Latest time in the aggregate rings
+    bool in_block_ = false;
+    uint64_t current_ = 0;
+    int64_t previous_[counter_count] = {};
+};
+
+// One raw row as handed out by HistoryReader::raw()
+struct RawRow {
+    int64_t time_ms;
+    uint64_t seen;
+    float gauges[gauge_count];
+    int64_t counters[counter_count];
+
+    // Value of a field, in its own unit
+    double value(Obis id) const {
+        for (size_t g = 0; g < gauge_count; ++g) {
+            if (gauge_columns[g] == id) return gauges[g];
+        }
+        for (size_t c = 0; c < counter_count; ++c) {
+            if (counter_columns[c] == id) return counters[c] / counter_scale(id);
+        }
+        return std::numeric_limits<double>::quiet_NaN();
+    }
+};
+
+class HistoryReader {
+public:
+    explicit HistoryReader(const std::string& path) : file_(path, false) {}
+
+    const HistoryFile& file() const {
+        return file_;
+    }
+
+    // Calls on_row for every raw row with from_ms <= time < to_ms, oldest
+    // first. Blocks entirely outside the range are skipped on their header.
+    template <typename Handler>
+    void raw(int64_t from_ms, int64_t to_ms, Handler&& on_row) const {
+        const FileHeader& file = file_.header();
+        uint64_t started = file.blocks_started.load(std::memory_order_acquire);
+        uint64_t first = started > file.block_count ? started - file.block_count + 1 : 1;
+        RawRow row;
+        for (uint64_t generation = first; generation <= started; ++generation) {
+            uint64_t index = (generation - 1) % file.block_count;
+            const BlockHeader& block = file_.block(index);
+            uint32_t rows = block.rows.load(std::memory_order_acquire);
+            if (block.generation.load(std::memory_order_relaxed) != generation || rows == 0) continue;
+            if (block.end_ms < from_ms || block.start_ms >= to_ms) continue;
+
+            std::memcpy(row.counters, block.base, sizeof(row.counters));
+            row.seen = block.seen;
+            const uint8_t* in = file_.varints(index);
+            const uint8_t* end = in + varint_capacity;
+            for (uint32_t r = 0; r < rows && in < end; ++r) {
+                uint64_t changed = get_varint(in, end);
+                for (size_t c = 0; c < counter_count; ++c) {
+                    if (!(changed & (uint64_t(1) << c))) continue;
+                    uint64_t zigzag = get_varint(in, end);
+                    row.counters[c] += static_cast<int64_t>(zigzag >> 1) ^ -static_cast<int64_t>(zigzag & 1);
+                }
+                row.time_ms = block.start_ms + file_.offsets(index)[r];
+                if (row.time_ms < from_ms || row.time_ms >= to_ms) continue;
+                for (size_t g = 0; g < gauge_count; ++g) row.gauges[g] = file_.gauges(index, g)[r];
+                on_row(row);
+            }
+            // The writer wrapped around onto this block while we read it
+            if (block.generation.load(std::memory_order_acquire) != generation) break;
+        }
+    }
+
+    // Aggregate rows (minute or quarter ring) with from_ms <= start < to_ms
+    template <typename Handler>
+    void minutes(int64_t from_ms, int64_t to_ms, Handler&& on_row) const {
+        aggregates(file_.header().minute_rows.load(std::memory_order_acquire), file_.header().minute_capacity,
+                   [this](uint64_t row) -> const AggregateRow& { return file_.minute(row); }, from_ms, to_ms, on_row);
+    }
+
+    template <typename Handler>
+    void quarters(int64_t from_ms, int64_t to_ms, Handler&& on_row) const {
+        aggregates(file_.header().quarter_rows.load(std::memory_order_acquire), file_.header().quarter_capacity,
+                   [this](uint64_t row) -> const AggregateRow& { return file_.quarter(row); }, from_ms, to_ms, on_row);
+    }
+
+private:
+    // Rows are in time order, so the first one is found by binary search
+    template <typename RowAt, typename Handler>
+    static void aggregates(uint64_t rows, uint64_t capacity, RowAt&& row_at, int64_t from_ms, int64_t to_ms, Handler& on_row) {
+        uint64_t low = rows > capacity ? rows - capacity : 0;
+        uint64_t high = rows;
+        while (low < high) {
+            uint64_t middle = low + (high - low) / 2;
+            if (row_at(middle).start_ms < from_ms) low = middle + 1;
+            else high = middle;
+        }
+        for (uint64_t row = low; row < rows && row_at(row).start_ms < to_ms; ++row) on_row(row_at(row));
+    }
+
+    static uint64_t get_varint(const uint8_t*& in, const uint8_t* end) {
+        uint64_t value = 0;
+        for (int shift = 0; shift < 64 && in < end; shift += 7) {
+            uint8_t byte = *in++;
+            value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+            if (!(byte & 0x80)) break;
+        }
+        return value;
+    }
+
+    HistoryFile file_;
+};
+
+} // namespace p1_history
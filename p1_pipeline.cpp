@@ -0,0 +1,241 @@
+#include "p1_pipeline.h"
+
+#include <algorithm>
+#include <charconv>
+#include <initializer_list>
+
+using namespace std;
+
+bool patch_obis_number(string& telegram, string_view prefix, double value) {
+    size_t line = telegram.find(prefix.data(), 0, prefix.size());
+    if (line == string::npos) return false;
+    size_t first = line + prefix.size();
+    // Only within the line: a malformed one must not spill into the next
+    size_t last = telegram.find_first_of("*)\r\n", first);
+    if (last == string::npos || last == first || (telegram[last] != '*' && telegram[last] != ')')) return false;
+
+    char* field = &telegram[first];
+    size_t width = last - first;
+    const char* point = static_cast<const char*>(memchr(field, '.', width));
+    int decimals = point ? static_cast<int>(field + width - point - 1) : 0;
+
+    char formatted[32];
+    auto result = to_chars(formatted, formatted + sizeof(formatted), max(value, 0.0), chars_format::fixed, decimals);
+    size_t length = result.ptr - formatted;
+    if (result.ec != errc() || length > width) {
+        for (size_t i = 0; i < width; ++i) {
+            if (field[i] != '.') field[i] = '9';
+        }
+        return true;
+    }
+    memset(field, '0', width - length);
+    memcpy(field + width - length, formatted, length);
+    return true;
+}
+
+void update_telegram_crc(string& telegram) {
+    size_t bang = telegram.rfind('!');
+    if (bang == string::npos || telegram.size() < bang + 5 || telegram[bang + 1] == '\r') return;
+    unsigned short checksum = Crc16::ComputeChecksum(string_view(telegram.data(), bang + 1));
+    static const char digits[] = "0123456789ABCDEF";
+    for (int i = 0; i < 4; ++i) {
+        telegram[bang + 1 + i] = digits[(checksum >> (12 - 4 * i)) & 0xF];
+    }
+}
+
+bool TelegramFramer::next(string_view& telegram) {
+    while (begin_ < end_) {
+        if (storage[begin_] != '/') {
+            const char* start = static_cast<const char*>(memchr(storage.data() + begin_, '/', end_ - begin_));
+            resync(start ? start - storage.data() : end_);
+            continue;
+        }
+        synced_ = true;
+
+        size_t mark = max(scan_, begin_ + 1);
+        while (mark < end_ && storage[mark] != '!' && storage[mark] != '/') ++mark;
+        if (mark == end_) {
+            scan_ = end_;
+            return wait();
+        }
+        if (storage[mark] == '/') {
+            // A new telegram started before the previous one was closed
+            resync(mark);
+            continue;
+        }
+
+        if (mark + 1 == end_) {
+            scan_ = mark;
+            return wait();
+        }
+        bool has_crc = storage[mark + 1] != '\r';
+        size_t frame_end = mark + (has_crc ? 7 : 3);
+        if (frame_end > end_) {
+            scan_ = mark;
+            return wait();
+        }
+        if (storage[frame_end - 2] != '\r' || storage[frame_end - 1] != '\n') {
+            resync(mark + 1);
+            continue;
+        }
+
+        const char* frame = storage.data() + begin_;
+        size_t body_length = mark + 1 - begin_;
+        size_t frame_length = frame_end - begin_;
+        begin_ = scan_ = frame_end;
+        if (has_crc) {
+            unsigned short expected = 0;
+            auto result = from_chars(frame + body_length, frame + body_length + 4, expected, 16);
+            auto crc_start = std::chrono::steady_clock::now();
+            unsigned short actual = Crc16::ComputeChecksum(string_view(frame, body_length));
+            stats_.last_crc_time = std::chrono::steady_clock::now() - crc_start;
+            if (result.ec != errc() || result.ptr != frame + body_length + 4 || expected != actual) {
+                ++stats_.crc_errors;
+                continue;
+            }
+            sends_crc_ = true;
+        } else if (sends_crc_) {
+            // A checksum line damaged into a bare "!"
+            ++stats_.crc_errors;
+            continue;
+        }
+        ++stats_.telegrams;
+        telegram = string_view(frame, frame_length);
+        return true;
+    }
+    return false;
+}
+
+bool TelegramFramer::wait() {
+    // A frame that fills the whole buffer can never complete, and the next
+    // prepare() would have no room left to read into
+    if (end_ - begin_ == capacity) {
+        ++stats_.oversize;
+        begin_ = scan_ = end_;
+        synced_ = false;
+    }
+    return false;
+}
+
+TelegramEncoder& TelegramEncoder::fixed(double value, int precision, size_t width) {
+    char digits[64];
+    auto result = to_chars(digits, digits + sizeof(digits), value, chars_format::fixed, precision);
+    pad(digits, result.ec == errc() ? result.ptr - digits : 0, width);
+    return *this;
+}
+
+TelegramEncoder& TelegramEncoder::integer(long long value, size_t width) {
+    char digits[24];
+    auto result = to_chars(digits, digits + sizeof(digits), value);
+    pad(digits, result.ptr - digits, width);
+    return *this;
+}
+
+bool TelegramEncoder::finish(bool checksum) {
+    static const char hex[] = "0123456789ABCDEF";
+    if (overflow_ || capacity - length_ < 6) return false;
+    unsigned short crc = crc_.finish();
+    for (int i = 0; checksum && i < 4; ++i) {
+        storage[length_++] = hex[(crc >> (12 - 4 * i)) & 0xF];
+    }
+    storage[length_++] = '\r';
+    storage[length_++] = '\n';
+    return true;
+}
+
+void TelegramEncoder::pad(const char* digits, size_t length, size_t width) {
+    static const char zeros[] = "0000000000000000";
+    if (length > 0 && digits[0] != '-' && width > length) append(zeros, min(width - length, sizeof(zeros) - 1));
+    append(digits, length);
+}
+
+void encode_obis_field(TelegramEncoder& encoder, const ObisValues& values, Obis id, double number) {
+    const ObisSchemaEntry& entry = schema_of(id);
+    // Characters of a number, including the decimal point
+    size_t width = entry.digits + (entry.decimals ? 1 : 0);
+    encoder.text(entry.reference).text("(");
+    switch (entry.type) {
+    case ObisType::number:
+        encoder.fixed(number, entry.decimals, width);
+        if (entry.unit) encoder.text("*").text(entry.unit);
+        break;
+    case ObisType::integer:
+        encoder.integer(static_cast<long long>(number), entry.digits);
+        break;
+    case ObisType::text:
+    case ObisType::whole_text:
+    case ObisType::mbus_legacy:
+        encoder.text(values.text(id));
+        break;
+    case ObisType::mbus:
+        encoder.text(values.text(id)).text(")(").fixed(number, entry.decimals, width);
+        if (entry.unit) encoder.text("*").text(entry.unit);
+        break;
+    }
+    encoder.text(")\r\n");
+}
+
+ChargerFeed::ChargerFeed(const ControllerSettings& settings, double current_limit, bool three_phases)
+    : controller_([&] {
+          ControllerSettings clamped = settings;
+          apply_current_limit(clamped, current_limit);
+          clamped.three_phases = three_phases;
+          return clamped;
+      }()),
+      current_limit_(current_limit) {}
+
+void ChargerFeed::receive(string_view telegram) {
+    meter_sends_crc_ = telegram.size() < 3 || telegram[telegram.size() - 3] != '!';
+    values_.begin_telegram();
+    tokenize_telegram(telegram,
+        [this](string_view id) { values_.set_header(id); },
+        [this](const ObisLine& line) { values_.store(line); });
+}
+
+void ChargerFeed::control(std::chrono::steady_clock::time_point now) {
+    std::array<PhaseMeasurement, 3> phases;
+    for (size_t i = 0; i < 3; ++i) {
+        phases[i] = {phase_current(i), values_.number(phase_delivered[i]), values_.number(phase_returned[i]),
+                     values_.number(phase_voltages[i])};
+    }
+    controller_.update(phases, std::chrono::duration<double>(now.time_since_epoch()).count());
+}
+
+bool ChargerFeed::rebuild(TelegramEncoder& encoder) const {
+    // The phase currents are always there: they are what the charger acts on
+    encoder.reset();
+    encoder.text("/").text(values_.header()).text("\r\n\r\n");
+    for (size_t i = 0; i < obis_field_count; ++i) {
+        Obis id = static_cast<Obis>(i);
+        const Obis* current = find(begin(phase_currents), end(phase_currents), id);
+        if (current != end(phase_currents)) {
+            encode_obis_field(encoder, values_, id, reported_current(current - phase_currents));
+        } else if (values_.seen(id)) {
+            encode_obis_field(encoder, values_, id, values_.number(id));
+        }
+    }
+    encoder.text("!");
+
+    // CRC16 over "/" up to and including "!", then CRLF
+    return encoder.finish(meter_sends_crc_);
+}
+
+void ChargerFeed::patch(string_view telegram, string& out) const {
+    out.assign(telegram.data(), telegram.size());
+    for (size_t i = 0; i < 3; ++i) {
+        const ObisSchemaEntry& entry = schema_of(phase_currents[i]);
+        char prefix[16];
+        size_t length = strlen(entry.reference);
+        memcpy(prefix, entry.reference, length);
+        prefix[length] = '(';
+        patch_obis_number(out, string_view(prefix, length + 1), reported_current(i));
+    }
+    update_telegram_crc(out);
+}
+
+bool ChargerFeed::in_phase_table(Obis id) {
+    for (const Obis* group : {phase_currents, phase_delivered, phase_returned}) {
+        if (find(group, group + 3, id) != group + 3) return true;
+    }
+    return false;
+}
@@ -0,0 +1,216 @@
+#pragma once
+
+// The path of one telegram through laadpaal, without any I/O: framing the
+// bytes read from the meter port, parsing them, running the current
+// controller and producing the telegram for the charger, either rebuilt
+// from the schema or the meter's own with the phase currents patched.
+// laadpaal wires this to the serial ports; p1bench and p1fuzz drive it
+// directly.
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+
+#include <boost/asio/buffer.hpp>
+
+#include "crc16.h"
+#include "current_controller.h"
+#include "obis_schema.h"
+
+// Overwrites the number in "<prefix>(number*unit)" keeping its width and
+// number of decimals, so the rest of the telegram does not move. Values that
+// do not fit are clamped to the largest number the field can hold.
+bool patch_obis_number(std::string& telegram, std::string_view prefix, double value);
+
+// Recomputes the "!XXXX" checksum after the body has been modified.
+// Telegrams without a checksum (DSMR 2.2/3) are left alone.
+void update_telegram_crc(std::string& telegram);
+
+// Rebuilds complete "/...!CRC\r\n" telegrams from the chunks async_read_some
+// delivers. Reads land directly in the framer's storage and telegrams are
+// handed out as views into it, valid until the next prepare().
+class TelegramFramer {
+public:
+    static const size_t capacity = 4096;
+
+    struct Stats {
+        uint64_t telegrams = 0;
+        uint64_t crc_errors = 0;
+        uint64_t oversize = 0;
+        uint64_t resyncs = 0;
+        std::chrono::nanoseconds last_crc_time{0};
+    };
+
+    // Free space for the next read. Unconsumed bytes are moved to the front
+    // only when the tail gets short, normally the buffer is empty by then.
+    boost::asio::mutable_buffer prepare() {
+        if (begin_ == end_) {
+            begin_ = end_ = scan_ = 0;
+        } else if (capacity - end_ < capacity / 4 && begin_ > 0) {
+            std::memmove(storage.data(), storage.data() + begin_, end_ - begin_);
+            scan_ -= begin_;
+            end_ -= begin_;
+            begin_ = 0;
+        }
+        return boost::asio::buffer(storage.data() + end_, capacity - end_);
+    }
+
+    // Bytes of an unfinished telegram are waiting
+    bool pending() const {
+        return begin_ != end_;
+    }
+
+    // Returns the bytes just added
+    std::string_view commit(size_t length) {
+        end_ += length;
+        return std::string_view(storage.data() + end_ - length, length);
+    }
+
+    // Returns the next telegram with a valid CRC. DSMR 2.2/3 telegrams end
+    // in a bare "!\r\n" and are passed through unchecked, but only until the
+    // first valid CRC: from then on a telegram without one counts as a CRC
+    // error.
+    bool next(std::string_view& telegram);
+
+    const Stats& stats() const {
+        return stats_;
+    }
+
+private:
+    // Waits for more bytes of an unfinished telegram; returns false
+    bool wait();
+
+    // Counted once per loss of sync, not once per skipped chunk
+    void resync(size_t position) {
+        if (synced_) ++stats_.resyncs;
+        synced_ = false;
+        begin_ = scan_ = position;
+    }
+
+    std::array<char, capacity> storage;
+    size_t begin_ = 0;
+    size_t end_ = 0;
+    size_t scan_ = 0;
+    bool synced_ = true;
+    bool sends_crc_ = false;  // The meter has sent a valid CRC
+    Stats stats_;
+};
+
+// Builds outgoing telegrams in a fixed buffer without touching the heap.
+// Every byte appended is fed through the CRC straight away, so finish()
+// only has to add the checksum that is already known.
+class TelegramEncoder {
+public:
+    static const size_t capacity = 4096;
+
+    void reset() {
+        length_ = 0;
+        crc_.reset();
+        overflow_ = false;
+    }
+
+    TelegramEncoder& text(std::string_view value) {
+        append(value.data(), value.size());
+        return *this;
+    }
+
+    // Same output as ostream << fixed << setprecision(precision), zero
+    // padded in front to at least width characters
+    TelegramEncoder& fixed(double value, int precision = 3, size_t width = 0);
+
+    TelegramEncoder& integer(long long value, size_t width = 0);
+
+    // Appends the checksum of everything written so far, plus CRLF. DSMR
+    // 2.2/3 telegrams have no checksum, only the CRLF. Returns false if the
+    // telegram did not fit.
+    bool finish(bool checksum = true);
+
+    std::string_view view() const {
+        return std::string_view(storage.data(), length_);
+    }
+
+private:
+    // Negative numbers are not padded, the meter never sends them
+    void pad(const char* digits, size_t length, size_t width);
+
+    void append(const char* data, size_t length) {
+        if (overflow_ || capacity - length_ < length) {
+            overflow_ = true;
+            return;
+        }
+        std::memcpy(storage.data() + length_, data, length);
+        crc_.update(reinterpret_cast<const unsigned char*>(data), length);
+        length_ += length;
+    }
+
+    std::array<char, capacity> storage;
+    size_t length_ = 0;
+    Crc16 crc_;
+    bool overflow_ = false;
+};
+
+// Writes one line of the schema, "<reference>(<value>)\r\n", in the DSMR
+// format of the field. number replaces the stored reading.
+void encode_obis_field(TelegramEncoder& encoder, const ObisValues& values, Obis id, double number);
+
+// The meter values of one port pair and the controller acting on them
+class ChargerFeed {
+public:
+    static constexpr Obis phase_currents[3] = {Obis::current_l1, Obis::current_l2, Obis::current_l3};
+    static constexpr Obis phase_delivered[3] = {Obis::power_delivered_l1, Obis::power_delivered_l2, Obis::power_delivered_l3};
+    static constexpr Obis phase_returned[3] = {Obis::power_returned_l1, Obis::power_returned_l2, Obis::power_returned_l3};
+    static constexpr Obis phase_voltages[3] = {Obis::voltage_l1, Obis::voltage_l2, Obis::voltage_l3};
+
+    // Limits of 0 or above the current limit become the current limit
+    ChargerFeed(const ControllerSettings& settings, double current_limit, bool three_phases);
+
+    // Parses a telegram the framer has accepted
+    void receive(std::string_view telegram);
+
+    // Feeds the per-phase controller, which rate-limits itself to its period
+    void control(std::chrono::steady_clock::time_point now);
+
+    // Every field the meter has sent, in schema order, with the reported
+    // phase currents. Returns false if it did not fit the encoder.
+    bool rebuild(TelegramEncoder& encoder) const;
+
+    // The meter's own telegram with only the phase currents replaced. Every
+    // other line, including ones rebuild() does not know about, is copied
+    // as is; out keeps its capacity between calls.
+    void patch(std::string_view telegram, std::string& out) const;
+
+    // Meter current of a phase, never above the current limit
+    double phase_current(size_t phase) const {
+        return std::min(values_.number(phase_currents[phase]), current_limit_);
+    }
+
+    // What the charger is told the phase carries
+    double reported_current(size_t phase) const {
+        return current_limit_ - controller_.output()[phase];
+    }
+
+    // Current, delivered and returned power per phase
+    static bool in_phase_table(Obis id);
+
+    const ObisValues& values() const {
+        return values_;
+    }
+
+    const CurrentController& controller() const {
+        return controller_;
+    }
+
+    double current_limit() const {
+        return current_limit_;
+    }
+
+private:
+    ObisValues values_;
+    CurrentController controller_;
+    double current_limit_;
+    bool meter_sends_crc_ = true;  // Rebuilt telegrams follow the meter: "!XXXX\r\n" or a bare "!\r\n"
+};
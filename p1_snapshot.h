@@ -0,0 +1,197 @@
+#pragma once
+
+// Latest meter values in POSIX shared memory, for other processes on the
+// same machine (EMS, dashboards, loggers). Written by `laadpaal --shm=<name>`,
+// read with SnapshotReader:
+//
+//     p1_snapshot::SnapshotReader reader("garage");
+//     p1_snapshot::Snapshot snapshot;
+//     if (reader.read(snapshot)) use(snapshot.values.number(Obis::power_delivered));
+//
+// The segment is guarded by a seqlock: the writer makes the sequence odd,
+// writes the new values straight into the segment and makes it even again,
+// and never waits for anyone. A reader copies the snapshot out and retries when the sequence was
+// odd or changed meanwhile, so any number of readers get consistent
+// snapshots without locks or system calls.
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+
+#include "obis_schema.h"
+
+namespace p1_snapshot {
+
+struct Snapshot {
+    uint64_t telegrams = 0;       // Telegrams published so far
+    int64_t time_ns = 0;          // Wall clock at publication, ns since 1970
+    double current_limit = 0;
+    double setpoints[3] = {0, 0, 0};  // Current the controller allows the charger per phase (mod)
+    double reported[3] = {0, 0, 0};   // Phase currents sent to the charger
+    ObisValues values;
+    uint64_t checksum = 0;        // FNV-1a of everything above, only from a writer with checksums on
+};
+
+static_assert(std::is_trivially_copyable<Snapshot>::value, "Snapshots are copied as bytes");
+
+// Lets readers check a copy independently of the seqlock. It costs about as
+// much as the whole telegram pipeline, so writers only fill it in for
+// stress tests.
+inline uint64_t checksum(const Snapshot& snapshot) {
+    const unsigned char* bytes = reinterpret_cast<const unsigned char*>(&snapshot);
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < offsetof(Snapshot, checksum); ++i) hash = (hash ^ bytes[i]) * 1099511628211ull;
+    return hash;
+}
+
+// Changes whenever the schema or the snapshot layout does, so a reader built
+// from another version refuses the segment instead of misreading it
+constexpr uint64_t layout_id() {
+    uint64_t hash = 14695981039346656037ull ^ sizeof(Snapshot);
+    for (const ObisSchemaEntry& entry : obis_schema) {
+        hash = (hash ^ entry.code) * 1099511628211ull;
+        hash = (hash ^ (static_cast<uint64_t>(entry.type) << 16 | entry.capacity)) * 1099511628211ull;
+    }
+    return hash;
+}
+
+const uint32_t magic = 0x50315348;  // "P1SH"
+const uint32_t checksummed = 1;     // Segment flag: every snapshot carries its checksum
+
+struct Segment {
+    uint32_t magic;
+    uint32_t flags;
+    uint64_t layout;
+    std::atomic<uint64_t> sequence;  // Odd while the writer is copying
+    Snapshot snapshot;
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "The sequence must work across processes");
+
+// "garage" becomes "/p1snapshot.garage" (a file in /dev/shm)
+inline std::string segment_name(const std::string& name) {
+    return "/p1snapshot." + name;
+}
+
+class SnapshotWriter {
+public:
+    explicit SnapshotWriter(const std::string& name, bool checksums = false)
+        : name_(segment_name(name)), checksums_(checksums) {
+        int fd = shm_open(name_.c_str(), O_CREAT | O_RDWR, 0644);
+        if (fd < 0) throw std::runtime_error("Cannot create shared memory " + name_ + ": " + std::strerror(errno));
+        if (ftruncate(fd, sizeof(Segment)) != 0) {
+            close(fd);
+            throw std::runtime_error("Cannot size shared memory " + name_ + ": " + std::strerror(errno));
+        }
+        void* memory = mmap(nullptr, sizeof(Segment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (memory == MAP_FAILED) throw std::runtime_error("Cannot map shared memory " + name_ + ": " + std::strerror(errno));
+        segment_ = static_cast<Segment*>(memory);
+
+        // A previous run may have left a segment behind; readers see a
+        // layout of 0 until it has been reset
+        segment_->layout = 0;
+        segment_->sequence.store(0, std::memory_order_relaxed);
+        std::memset(static_cast<void*>(&segment_->snapshot), 0, sizeof(Snapshot));
+        segment_->flags = checksums_ ? checksummed : 0;
+        segment_->magic = magic;
+        std::atomic_thread_fence(std::memory_order_release);
+        segment_->layout = layout_id();
+    }
+
+    ~SnapshotWriter() {
+        munmap(segment_, sizeof(Segment));
+        shm_unlink(name_.c_str());
+    }
+
+    SnapshotWriter(const SnapshotWriter&) = delete;
+    SnapshotWriter& operator=(const SnapshotWriter&) = delete;
+
+    // One writer per segment. fill(snapshot) updates the snapshot in the
+    // segment itself, so publishing costs no copy besides the one fill
+    // makes; fields it leaves alone keep their previous value.
+    template <typename Fill>
+    void publish(Fill&& fill) {
+        uint64_t sequence = segment_->sequence.load(std::memory_order_relaxed);
+        segment_->sequence.store(sequence + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        fill(segment_->snapshot);
+        if (checksums_) segment_->snapshot.checksum = checksum(segment_->snapshot);
+        segment_->sequence.store(sequence + 2, std::memory_order_release);
+    }
+
+private:
+    std::string name_;
+    bool checksums_;
+    Segment* segment_;
+};
+
+class SnapshotReader {
+public:
+    explicit SnapshotReader(const std::string& name) : name_(segment_name(name)) {
+        int fd = shm_open(name_.c_str(), O_RDONLY, 0);
+        if (fd < 0) throw std::runtime_error("Cannot open shared memory " + name_ + ": " + std::strerror(errno));
+        void* memory = mmap(nullptr, sizeof(Segment), PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (memory == MAP_FAILED) throw std::runtime_error("Cannot map shared memory " + name_ + ": " + std::strerror(errno));
+        segment_ = static_cast<const Segment*>(memory);
+        if (segment_->magic != magic || segment_->layout != layout_id()) {
+            munmap(const_cast<Segment*>(segment_), sizeof(Segment));
+            throw std::runtime_error(name_ + " is not ready or was written by another version of laadpaal");
+        }
+    }
+
+    ~SnapshotReader() {
+        munmap(const_cast<Segment*>(segment_), sizeof(Segment));
+    }
+
+    SnapshotReader(const SnapshotReader&) = delete;
+    SnapshotReader& operator=(const SnapshotReader&) = delete;
+
+    // Copies the latest snapshot. Returns false while nothing has been
+    // published yet, or when the writer died halfway through a copy.
+    // retries, if given, counts the copies that were thrown away because
+    // the writer got in between.
+    bool read(Snapshot& snapshot, uint64_t* retries = nullptr) const {
+        for (int attempt = 0; attempt < max_attempts; ++attempt) {
+            uint64_t before = segment_->sequence.load(std::memory_order_acquire);
+            if (before == 0) return false;
+            if (!(before & 1)) {
+                std::memcpy(static_cast<void*>(&snapshot), &segment_->snapshot, sizeof(Snapshot));
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (segment_->sequence.load(std::memory_order_relaxed) == before) return true;
+            }
+            if (retries) ++*retries;
+        }
+        return false;
+    }
+
+    // Cheap check for news: changes with every publication
+    uint64_t sequence() const {
+        return segment_->sequence.load(std::memory_order_acquire);
+    }
+
+    // The writer fills in Snapshot::checksum
+    bool checksummed() const {
+        return segment_->flags & p1_snapshot::checksummed;
+    }
+
+private:
+    // A copy takes a microsecond, the writer publishes once per telegram
+    static constexpr int max_attempts = 100000;
+
+    std::string name_;
+    const Segment* segment_;
+};
+
+} // namespace p1_snapshot
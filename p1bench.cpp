@@ -0,0 +1,346 @@
+// Benchmarks for the telegram pipeline (p1_pipeline.h), run over recorded
+// captures so the numbers reflect real meters.
+//
+//   p1bench [--min-time=<s>] [--only=<name>[,<name>...]] [--csv] <capture.p1cap>...
+//
+// Per capture it times, per telegram:
+//   crc        Crc16::ComputeChecksum over the telegram
+//   frame      the framer splitting the recorded read chunks into telegrams
+//   regex      the regex parse laadpaal used before the tokenizer, as a baseline
+//   parse      ChargerFeed::receive (was process_received_data)
+//   control    ChargerFeed::control (was calc_current), one controller step
+//   rebuild    ChargerFeed::rebuild (was the encoding in send_data)
+//   patch      ChargerFeed::patch (was forward_telegram)
+//   pipeline   all of the above as laadpaal --passthrough does it, end to end
+// Next to the time it reports the heap allocations per telegram, counted by
+// a replaced operator new. --csv prints one line per result, to keep next
+// to the commit it measured.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <new>
+#include <regex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "p1_capture.h"
+#include "p1_pipeline.h"
+
+using namespace std;
+
+// Every allocation in the process; the benchmarks run on one thread
+static uint64_t allocations = 0;
+
+void* operator new(size_t size) {
+    ++allocations;
+    if (void* memory = malloc(size ? size : 1)) return memory;
+    throw bad_alloc();
+}
+
+void operator delete(void* memory) noexcept {
+    free(memory);
+}
+
+void operator delete(void* memory, size_t) noexcept {
+    free(memory);
+}
+
+struct Options {
+    vector<string> captures;
+    vector<string> only;
+    double min_time = 0.5;
+    bool csv = false;
+};
+
+struct Corpus {
+    string name;
+    vector<vector<char>> chunks;  // Reads as the serial port returned them
+    vector<string> telegrams;     // The valid telegrams in them
+    size_t bytes = 0;
+};
+
+static void usage(const char* name) {
+    cerr << "Usage: " << name << " [--min-time=<s>] [--only=<name>[,<name>...]] [--csv] <capture.p1cap>...\n"
+         << "Benchmarks: crc frame regex parse control rebuild patch pipeline\n";
+}
+
+static Options parse_options(int argc, char* argv[]) {
+    Options options;
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg == "--csv") options.csv = true;
+        else if (arg.compare(0, 11, "--min-time=") == 0) options.min_time = stod(arg.substr(11));
+        else if (arg.compare(0, 7, "--only=") == 0) {
+            istringstream stream(arg.substr(7));
+            string name;
+            while (getline(stream, name, ',')) options.only.push_back(name);
+        }
+        else if (arg.compare(0, 2, "--") == 0) throw invalid_argument("Unknown option " + arg);
+        else options.captures.push_back(arg);
+    }
+    if (options.captures.empty()) throw invalid_argument("No capture files given");
+    return options;
+}
+
+// process_received_data as it was before the tokenizer: 31 regexes built on
+// every call, each searching the whole telegram, values parsed with stod
+struct RegexValues {
+    string id, timestamp, equipment_id, failure_log;
+    double version = 0, tariff1_in = 0, tariff2_in = 0, tariff1_out = 0, tariff2_out = 0;
+    double power_in = 0, power_out = 0;
+    int tariff = 0, failures = 0, long_failures = 0;
+    int sags[3] = {}, swells[3] = {};
+    double voltages[3] = {}, currents[3] = {}, delivered[3] = {}, returned[3] = {};
+
+    void parse(const string& data, double current_limit) {
+        smatch match;
+        regex regex_id(R"(/(.*)\r\n)");
+        regex regex_0_2_8(R"(1-3:0\.2\.8\(([\d\.]+)\))");
+        regex regex_1_0_0(R"(0-0:1\.0\.0\(([\d\.]+[SW])\))");
+        regex regex_96_1_1(R"(0-0:96\.1\.1\(([\d\.]+)\))");
+        regex regex_1_8_1(R"(1-0:1\.8\.1\(([\d\.]+)\*kWh\))");
+        regex regex_1_8_2(R"(1-0:1\.8\.2\(([\d\.]+)\*kWh\))");
+        regex regex_2_8_1(R"(1-0:2\.8\.1\(([\d\.]+)\*kWh\))");
+        regex regex_2_8_2(R"(1-0:2\.8\.2\(([\d\.]+)\*kWh\))");
+        regex regex_96_14_0(R"(0-0:96\.14\.0\((\d+)\))");
+        regex regex_1_7_0(R"(1-0:1\.7\.0\(([\d\.]+)\*kW\))");
+        regex regex_2_7_0(R"(1-0:2\.7\.0\(([\d\.]+)\*kW\))");
+        regex regex_96_7_21(R"(0-0:96\.7\.21\((\d+)\))");
+        regex regex_96_7_9(R"(0-0:96\.7\.9\((\d+)\))");
+        regex regex_99_97_0(R"(1-0:99\.97\.0\((.+)\))");
+        regex regex_32_32_0(R"(1-0:32\.32\.0\((\d+)\))");
+        regex regex_52_32_0(R"(1-0:52\.32\.0\((\d+)\))");
+        regex regex_72_32_0(R"(1-0:72\.32\.0\((\d+)\))");
+        regex regex_32_36_0(R"(1-0:32\.36\.0\((\d+)\))");
+        regex regex_52_36_0(R"(1-0:52\.36\.0\((\d+)\))");
+        regex regex_72_36_0(R"(1-0:72\.36\.0\((\d+)\))");
+        regex regex_32_7_0(R"(1-0:32\.7\.0\(([\d\.]+)\*V\))");
+        regex regex_52_7_0(R"(1-0:52\.7\.0\(([\d\.]+)\*V\))");
+        regex regex_72_7_0(R"(1-0:72\.7\.0\(([\d\.]+)\*V\))");
+        regex regex_31_7_0(R"(1-0:31\.7\.0\(([\d\.]+)\*A\))");
+        regex regex_51_7_0(R"(1-0:51\.7\.0\(([\d\.]+)\*A\))");
+        regex regex_71_7_0(R"(1-0:71\.7\.0\(([\d\.]+)\*A\))");
+        regex regex_21_7_0(R"(1-0:21\.7\.0\(([\d\.]+)\*kW\))");
+        regex regex_41_7_0(R"(1-0:41\.7\.0\(([\d\.]+)\*kW\))");
+        regex regex_61_7_0(R"(1-0:61\.7\.0\(([\d\.]+)\*kW\))");
+        regex regex_22_7_0(R"(1-0:22\.7\.0\(([\d\.]+)\*kW\))");
+        regex regex_42_7_0(R"(1-0:42\.7\.0\(([\d\.]+)\*kW\))");
+        regex regex_62_7_0(R"(1-0:62\.7\.0\(([\d\.]+)\*kW\))");
+
+        if (regex_search(data, match, regex_id)) id = match[1];
+        if (regex_search(data, match, regex_0_2_8)) version = stod(match[1]);
+        if (regex_search(data, match, regex_1_0_0)) timestamp = match[1];
+        if (regex_search(data, match, regex_96_1_1)) equipment_id = match[1];
+        if (regex_search(data, match, regex_1_8_1)) tariff1_in = stod(match[1]);
+        if (regex_search(data, match, regex_1_8_2)) tariff2_in = stod(match[1]);
+        if (regex_search(data, match, regex_2_8_1)) tariff1_out = stod(match[1]);
+        if (regex_search(data, match, regex_2_8_2)) tariff2_out = stod(match[1]);
+        if (regex_search(data, match, regex_96_14_0)) tariff = stoi(match[1]);
+        if (regex_search(data, match, regex_1_7_0)) power_in = stod(match[1]);
+        if (regex_search(data, match, regex_2_7_0)) power_out = stod(match[1]);
+        if (regex_search(data, match, regex_96_7_21)) failures = stoi(match[1]);
+        if (regex_search(data, match, regex_96_7_9)) long_failures = stoi(match[1]);
+        if (regex_search(data, match, regex_99_97_0)) failure_log = match[1];
+        if (regex_search(data, match, regex_32_32_0)) sags[0] = stoi(match[1]);
+        if (regex_search(data, match, regex_52_32_0)) sags[1] = stoi(match[1]);
+        if (regex_search(data, match, regex_72_32_0)) sags[2] = stoi(match[1]);
+        if (regex_search(data, match, regex_32_36_0)) swells[0] = stoi(match[1]);
+        if (regex_search(data, match, regex_52_36_0)) swells[1] = stoi(match[1]);
+        if (regex_search(data, match, regex_72_36_0)) swells[2] = stoi(match[1]);
+        if (regex_search(data, match, regex_32_7_0)) voltages[0] = stod(match[1]);
+        if (regex_search(data, match, regex_52_7_0)) voltages[1] = stod(match[1]);
+        if (regex_search(data, match, regex_72_7_0)) voltages[2] = stod(match[1]);
+        if (regex_search(data, match, regex_31_7_0)) currents[0] = min(stod(match[1]), current_limit);
+        if (regex_search(data, match, regex_51_7_0)) currents[1] = min(stod(match[1]), current_limit);
+        if (regex_search(data, match, regex_71_7_0)) currents[2] = min(stod(match[1]), current_limit);
+        if (regex_search(data, match, regex_21_7_0)) delivered[0] = stod(match[1]);
+        if (regex_search(data, match, regex_41_7_0)) delivered[1] = stod(match[1]);
+        if (regex_search(data, match, regex_61_7_0)) delivered[2] = stod(match[1]);
+        if (regex_search(data, match, regex_22_7_0)) returned[0] = stod(match[1]);
+        if (regex_search(data, match, regex_42_7_0)) returned[1] = stod(match[1]);
+        if (regex_search(data, match, regex_62_7_0)) returned[2] = stod(match[1]);
+    }
+};
+
+static Corpus load_corpus(const string& path) {
+    Corpus corpus;
+    size_t slash = path.rfind('/');
+    corpus.name = slash == string::npos ? path : path.substr(slash + 1);
+    p1_capture::Reader reader(path);
+    p1_capture::Record record;
+    TelegramFramer framer;
+    while (reader.next(record)) {
+        corpus.chunks.push_back(record.data);
+        // Captures are cut into reads; the framer needs at most its capacity at once
+        for (size_t offset = 0; offset < record.data.size();) {
+            auto space = framer.prepare();
+            size_t length = min(space.size(), record.data.size() - offset);
+            memcpy(space.data(), record.data.data() + offset, length);
+            framer.commit(length);
+            offset += length;
+            string_view telegram;
+            while (framer.next(telegram)) {
+                corpus.telegrams.emplace_back(telegram);
+                corpus.bytes += telegram.size();
+            }
+        }
+    }
+    if (corpus.telegrams.empty()) throw runtime_error(path + " holds no valid telegrams");
+    return corpus;
+}
+
+// Keeps the optimizer from dropping work whose result is never used
+static volatile uint64_t sink;
+
+struct Result {
+    double ns;           // Per telegram
+    double allocations;  // Per telegram
+};
+
+// Runs one pass over the corpus until min_time has passed
+template <typename Pass>
+static Result measure(const Corpus& corpus, double min_time, Pass&& pass) {
+    pass();  // Warm up caches and the branch predictor
+    uint64_t passes = 0;
+    uint64_t allocations_before = allocations;
+    auto start = chrono::steady_clock::now();
+    chrono::duration<double> elapsed{0};
+    do {
+        pass();
+        ++passes;
+        elapsed = chrono::steady_clock::now() - start;
+    } while (elapsed.count() < min_time);
+    double telegrams = static_cast<double>(passes * corpus.telegrams.size());
+    return {elapsed.count() * 1e9 / telegrams, (allocations - allocations_before) / telegrams};
+}
+
+// Feeds the recorded chunks through the framer as laadpaal reads them
+template <typename Handler>
+static void feed_chunks(TelegramFramer& framer, const Corpus& corpus, Handler&& handler) {
+    for (const vector<char>& chunk : corpus.chunks) {
+        for (size_t offset = 0; offset < chunk.size();) {
+            auto space = framer.prepare();
+            size_t length = min(space.size(), chunk.size() - offset);
+            memcpy(space.data(), chunk.data() + offset, length);
+            framer.commit(length);
+            offset += length;
+            string_view telegram;
+            while (framer.next(telegram)) handler(telegram);
+        }
+    }
+}
+
+static void run(const Corpus& corpus, const Options& options) {
+    auto wanted = [&](const string& name) {
+        return options.only.empty() || find(options.only.begin(), options.only.end(), name) != options.only.end();
+    };
+    auto report = [&](const string& name, Result result) {
+        double per_second = 1e9 / result.ns;
+        double mb_per_second = per_second * corpus.bytes / corpus.telegrams.size() / 1e6;
+        if (options.csv) {
+            cout << name << "," << corpus.name << "," << fixed << setprecision(1) << result.ns << "," << setprecision(0)
+                 << per_second << "," << setprecision(2) << mb_per_second << "," << result.allocations << "\n";
+        } else {
+            cout << "  " << left << setw(10) << name << right << fixed << setprecision(1) << setw(10) << result.ns << " ns"
+                 << setprecision(0) << setw(12) << per_second << " /s" << setprecision(1) << setw(9) << mb_per_second << " MB/s"
+                 << setprecision(2) << setw(10) << result.allocations << " allocs\n";
+        }
+    };
+    if (!options.csv) {
+        cout << corpus.name << ": " << corpus.telegrams.size() << " telegrams, "
+             << corpus.bytes / corpus.telegrams.size() << " bytes each, per telegram:\n";
+    }
+
+    ChargerFeed feed(ControllerSettings(), 25, true);
+    TelegramEncoder encoder;
+    string outbound;
+    outbound.reserve(TelegramFramer::capacity);
+    // The controller only steps once per period; every call is a step here
+    auto now = chrono::steady_clock::time_point();
+    auto next_period = [&now] { return now += chrono::seconds(1); };
+
+    if (wanted("crc")) {
+        report("crc", measure(corpus, options.min_time, [&] {
+            for (const string& telegram : corpus.telegrams) sink += Crc16::ComputeChecksum(telegram);
+        }));
+    }
+    if (wanted("frame")) {
+        TelegramFramer framer;
+        report("frame", measure(corpus, options.min_time, [&] {
+            feed_chunks(framer, corpus, [](string_view telegram) { sink += telegram.size(); });
+        }));
+    }
+    if (wanted("regex")) {
+        RegexValues regex_values;
+        report("regex", measure(corpus, options.min_time, [&] {
+            for (const string& telegram : corpus.telegrams) regex_values.parse(telegram, feed.current_limit());
+            sink += static_cast<uint64_t>(regex_values.tariff1_in);
+        }));
+    }
+    if (wanted("parse")) {
+        report("parse", measure(corpus, options.min_time, [&] {
+            for (const string& telegram : corpus.telegrams) feed.receive(telegram);
+            sink += feed.values().telegrams();
+        }));
+    }
+    if (wanted("control")) {
+        report("control", measure(corpus, options.min_time, [&] {
+            for (size_t i = 0; i < corpus.telegrams.size(); ++i) feed.control(next_period());
+            sink += static_cast<uint64_t>(feed.controller().output()[0]);
+        }));
+    }
+    if (wanted("rebuild")) {
+        report("rebuild", measure(corpus, options.min_time, [&] {
+            for (size_t i = 0; i < corpus.telegrams.size(); ++i) {
+                feed.rebuild(encoder);
+                sink += encoder.view().size();
+            }
+        }));
+    }
+    if (wanted("patch")) {
+        report("patch", measure(corpus, options.min_time, [&] {
+            for (const string& telegram : corpus.telegrams) {
+                feed.patch(telegram, outbound);
+                sink += outbound.size();
+            }
+        }));
+    }
+    if (wanted("pipeline")) {
+        TelegramFramer framer;
+        report("pipeline", measure(corpus, options.min_time, [&] {
+            feed_chunks(framer, corpus, [&](string_view telegram) {
+                feed.receive(telegram);
+                feed.control(next_period());
+                feed.patch(telegram, outbound);
+                sink += outbound.size();
+            });
+        }));
+    }
+}
+
+int main(int argc, char* argv[]) {
+    try {
+        Options options;
+        try {
+            options = parse_options(argc, argv);
+        } catch (const exception& e) {
+            cerr << e.what() << endl;
+            usage(argv[0]);
+            return 1;
+        }
+
+        if (options.csv) cout << "benchmark,corpus,ns_per_telegram,telegrams_per_second,mb_per_second,allocations_per_telegram\n";
+        for (const string& path : options.captures) run(load_corpus(path), options);
+    }
+    catch (const exception& e) {
+        cerr << "Exception: " << e.what() << endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,86 @@
+// libFuzzer target for the telegram parser: arbitrary bytes from the meter
+// port go through the framer, the parser and both ways of producing the
+// charger telegram, as in laadpaal.
+//
+//   make p1fuzz && ./p1fuzz -max_len=8192 corpus/
+//
+// The first input byte sets the read size and the number of phases, so the
+// fuzzer also explores how telegrams are split over reads. Besides the sanitizers, every telegram
+// sent to the charger must pass the framer itself: a valid CRC, and for a
+// patched telegram the same length as the meter's.
+//
+// p1fuzz-replay is the same target built with g++ and a main() that runs each
+// file given on the command line once, e.g. a capture or a crash reproducer.
+// make check replays every file in corpus/, the inputs that once found a bug.
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <initializer_list>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include "p1_pipeline.h"
+
+using namespace std;
+
+// The charger would reject what the framer rejects
+static void check_outgoing(string_view telegram) {
+    TelegramFramer framer;
+    auto space = framer.prepare();
+    if (telegram.size() > space.size()) abort();
+    memcpy(space.data(), telegram.data(), telegram.size());
+    framer.commit(telegram.size());
+    string_view checked;
+    if (!framer.next(checked) || checked != telegram) abort();
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+    if (size == 0) return 0;
+    size_t read_size = data[0] % 64 + 1;
+    bool three_phases = data[0] & 0x80;
+    ++data;
+    --size;
+
+    ChargerFeed feed(ControllerSettings(), 16, three_phases);
+    TelegramFramer framer;
+    TelegramEncoder encoder;
+    string patched;
+    auto now = std::chrono::steady_clock::time_point();
+    for (size_t offset = 0; offset < size;) {
+        auto space = framer.prepare();
+        size_t length = min({read_size, space.size(), size - offset});
+        memcpy(space.data(), data + offset, length);
+        framer.commit(length);
+        offset += length;
+
+        string_view telegram;
+        while (framer.next(telegram)) {
+            feed.receive(telegram);
+            feed.control(now += std::chrono::seconds(1));
+            feed.patch(telegram, patched);
+            if (patched.size() != telegram.size()) abort();
+            check_outgoing(patched);
+            if (feed.rebuild(encoder)) check_outgoing(encoder.view());
+        }
+    }
+    return 0;
+}
+
+#ifdef P1FUZZ_REPLAY
+int main(int argc, char* argv[]) {
+    for (int i = 1; i < argc; ++i) {
+        ifstream file(argv[i], ios::binary);
+        if (!file) {
+            fprintf(stderr, "Cannot open %s\n", argv[i]);
+            return 1;
+        }
+        vector<uint8_t> input((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+        LLVMFuzzerTestOneInput(input.data(), input.size());
+        printf("%s: ok\n", argv[i]);
+    }
+    return 0;
+}
+#endif
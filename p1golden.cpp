@@ -0,0 +1,327 @@
+// Pins the bytes laadpaal sends to the charger: replays captures through
+// ChargerFeed and compares every outgoing telegram with the expected output
+// committed next to them.
+//
+//   p1golden [--update] <expected dir> <capture.p1cap>...
+//
+// For each capture two files are compared, <dir>/<capture>.rebuild (the
+// telegrams rebuilt from the schema, as sent without --passthrough) and
+// <dir>/<capture>.patch (the meter's telegrams with the phase currents
+// replaced, as with --passthrough). The controller runs on the capture's own
+// clock with a 25 A current limit and a one-phase car, the same on every
+// machine. --update writes the files instead, after a deliberate change to
+// the output. The expected files are generated by p1golden itself, so they
+// only catch changes from the day they were written.
+//
+// What ties TelegramEncoder to the stringstream code it replaced is a second
+// check: every rebuilt telegram is formatted again with an ostringstream,
+// the way send_data did before the encoder (fixed, setprecision, zero fill,
+// the checksum as four uppercase hex digits), and must come out the same.
+//
+// Every telegram also has its CRC computed from each alignment in memory and
+// compared with the bitwise reference, at run time, outside constexpr.
+
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <cmath>
+#include <initializer_list>
+#include <iomanip>
+#include <iostream>
+#include <iterator>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "p1_capture.h"
+#include "p1_pipeline.h"
+
+using namespace std;
+
+// A DSMR 5 telegram as the meter sent it, checksum "6EEE"
+constexpr string_view dsmr5_telegram =
+    "/ISk5\\2MT382-1000\r\n\r\n"
+    "1-3:0.2.8(50)\r\n"
+    "0-0:1.0.0(170102192002W)\r\n"
+    "0-0:96.1.1(4B384547303034303436333935353037)\r\n"
+    "1-0:1.8.1(000004.426*kWh)\r\n"
+    "1-0:1.8.2(000002.399*kWh)\r\n"
+    "1-0:2.8.1(000002.444*kWh)\r\n"
+    "1-0:2.8.2(000000.000*kWh)\r\n"
+    "0-0:96.14.0(0002)\r\n"
+    "1-0:1.7.0(00.244*kW)\r\n"
+    "1-0:2.7.0(00.000*kW)\r\n"
+    "0-0:96.7.21(00013)\r\n"
+    "0-0:96.7.9(00000)\r\n"
+    "1-0:99.97.0(0)(0-0:96.7.19)\r\n"
+    "1-0:32.32.0(00000)\r\n"
+    "1-0:52.32.0(00000)\r\n"
+    "1-0:72.32.0(00000)\r\n"
+    "1-0:32.36.0(00000)\r\n"
+    "1-0:52.36.0(00000)\r\n"
+    "1-0:72.36.0(00000)\r\n"
+    "0-0:96.13.0()\r\n"
+    "1-0:32.7.0(0230.0*V)\r\n"
+    "1-0:52.7.0(0230.0*V)\r\n"
+    "1-0:72.7.0(0229.0*V)\r\n"
+    "1-0:31.7.0(0.48*A)\r\n"
+    "1-0:51.7.0(0.44*A)\r\n"
+    "1-0:71.7.0(0.86*A)\r\n"
+    "1-0:21.7.0(00.070*kW)\r\n"
+    "1-0:41.7.0(00.032*kW)\r\n"
+    "1-0:61.7.0(00.142*kW)\r\n"
+    "1-0:22.7.0(00.000*kW)\r\n"
+    "1-0:42.7.0(00.000*kW)\r\n"
+    "1-0:62.7.0(00.000*kW)\r\n"
+    "0-1:24.1.0(003)\r\n"
+    "0-1:96.1.0(3232323241424344313233343536373839)\r\n"
+    "0-1:24.2.1(170102161005W)(00000.107*m3)\r\n"
+    "0-2:24.1.0(003)\r\n"
+    "0-2:96.1.0()\r\n"
+    "!";
+static_assert(Crc16::ComputeChecksum(dsmr5_telegram) == 0x6EEE, "CRC16 of a known DSMR 5 telegram");
+
+struct Options {
+    string expected_dir;
+    vector<string> captures;
+    bool update = false;
+};
+
+static void usage(const char* name) {
+    cerr << "Usage: " << name << " [--update] <expected dir> <capture.p1cap>...\n";
+}
+
+static Options parse_options(int argc, char* argv[]) {
+    Options options;
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg == "--update") options.update = true;
+        else if (arg.compare(0, 2, "--") == 0) throw invalid_argument("Unknown option " + arg);
+        else if (options.expected_dir.empty()) options.expected_dir = arg;
+        else options.captures.push_back(arg);
+    }
+    if (options.captures.empty()) throw invalid_argument("No capture files given");
+    return options;
+}
+
+// The outgoing telegrams of one capture, one entry per telegram
+struct Output {
+    vector<string> rebuild;
+    vector<string> patch;
+    string stream_difference;  // First telegram where the stream reference differs, empty if none
+};
+
+// First line where the two telegrams differ, with its line number
+static string first_difference(const string& expected, const string& actual) {
+    istringstream expected_lines(expected), actual_lines(actual);
+    string expected_line, actual_line;
+    for (int line = 1;; ++line) {
+        bool more_expected = static_cast<bool>(getline(expected_lines, expected_line));
+        bool more_actual = static_cast<bool>(getline(actual_lines, actual_line));
+        if (!more_expected && !more_actual) return "lengths differ";
+        for (string* text : {&expected_line, &actual_line}) {
+            if (!text->empty() && text->back() == '\r') text->pop_back();
+        }
+        if (expected_line != actual_line || more_expected != more_actual) {
+            return "line " + to_string(line) + ": expected \"" + (more_expected ? expected_line : "<end>") +
+                   "\", got \"" + (more_actual ? actual_line : "<end>") + "\"";
+        }
+    }
+}
+
+// Test-only reference for TelegramEncoder: the rebuilt telegram formatted
+// with iostreams, as before the encoder existed
+static void stream_number(ostringstream& out, double number, int precision, size_t width) {
+    // The encoder pads non-negative numbers only; setw would put the zeros
+    // in front of the minus sign
+    if (!signbit(number)) out << setw(static_cast<int>(width)) << setfill('0');
+    out << fixed << setprecision(precision) << number;
+}
+
+static string stream_rebuild(const ChargerFeed& feed, string_view received) {
+    const ObisValues& values = feed.values();
+    ostringstream out;
+    out << "/" << values.header() << "\r\n\r\n";
+    for (size_t i = 0; i < obis_field_count; ++i) {
+        Obis id = static_cast<Obis>(i);
+        const Obis* current = find(begin(ChargerFeed::phase_currents), end(ChargerFeed::phase_currents), id);
+        if (current == end(ChargerFeed::phase_currents) && !values.seen(id)) continue;
+        double number = current != end(ChargerFeed::phase_currents) ? feed.reported_current(current - ChargerFeed::phase_currents)
+                                                                    : values.number(id);
+        const ObisSchemaEntry& entry = schema_of(id);
+        size_t width = entry.digits + (entry.decimals ? 1 : 0);
+        out << entry.reference << "(";
+        switch (entry.type) {
+        case ObisType::number:
+            stream_number(out, number, entry.decimals, width);
+            if (entry.unit) out << "*" << entry.unit;
+            break;
+        case ObisType::integer: {
+            long long integer = static_cast<long long>(number);
+            if (integer >= 0) out << setw(entry.digits) << setfill('0');
+            out << integer;
+            break;
+        }
+        case ObisType::text:
+        case ObisType::whole_text:
+        case ObisType::mbus_legacy:
+            out << values.text(id);
+            break;
+        case ObisType::mbus:
+            out << values.text(id) << ")(";
+            stream_number(out, number, entry.decimals, width);
+            if (entry.unit) out << "*" << entry.unit;
+            break;
+        }
+        out << ")\r\n";
+    }
+    out << "!";
+    // The meter's own choice: "!XXXX\r\n" or, for DSMR 2.2/3, a bare "!\r\n"
+    if (received.size() >= 3 && received[received.size() - 3] != '!') {
+        out << setw(4) << setfill('0') << hex << uppercase << crc16_reference(out.str());
+    }
+    out << "\r\n";
+    return out.str();
+}
+
+static Output replay(const string& path) {
+    Output output;
+    ChargerFeed feed(ControllerSettings(), 25, false);
+    TelegramFramer framer;
+    TelegramEncoder encoder;
+    string patched;
+    p1_capture::Reader reader(path);
+    p1_capture::Record record;
+    auto now = std::chrono::steady_clock::time_point();
+    while (reader.next(record)) {
+        now += std::chrono::microseconds(record.delta_us);
+        for (size_t offset = 0; offset < record.data.size();) {
+            auto space = framer.prepare();
+            size_t length = min(space.size(), record.data.size() - offset);
+            memcpy(space.data(), record.data.data() + offset, length);
+            framer.commit(length);
+            offset += length;
+            string_view telegram;
+            while (framer.next(telegram)) {
+                feed.receive(telegram);
+                feed.control(now);
+                feed.patch(telegram, patched);
+                output.patch.push_back(patched);
+                if (!feed.rebuild(encoder)) throw runtime_error(path + ": rebuilt telegram does not fit");
+                output.rebuild.emplace_back(encoder.view());
+                string reference = stream_rebuild(feed, telegram);
+                if (output.stream_difference.empty() && reference != output.rebuild.back()) {
+                    output.stream_difference = "telegram " + to_string(output.rebuild.size()) + ", " +
+                                               first_difference(reference, output.rebuild.back());
+                }
+            }
+        }
+    }
+    if (output.patch.empty()) throw runtime_error(path + " holds no valid telegrams");
+    return output;
+}
+
+static string join(const vector<string>& telegrams) {
+    string joined;
+    for (const string& telegram : telegrams) joined += telegram;
+    return joined;
+}
+
+// Splits at every "\r\n/", so a difference can be reported per telegram
+static vector<string> split(const string& data) {
+    vector<string> telegrams;
+    size_t start = 0;
+    while (start < data.size()) {
+        size_t next = data.find("\r\n/", start);
+        size_t end = next == string::npos ? data.size() : next + 2;
+        telegrams.push_back(data.substr(start, end - start));
+        start = end;
+    }
+    return telegrams;
+}
+
+// Returns false, after reporting the first difference, if the output changed
+static bool compare(const string& path, const vector<string>& actual) {
+    ifstream file(path, ios::binary);
+    if (!file) throw runtime_error("Cannot open " + path + " (create it with --update)");
+    vector<string> expected = split(string(istreambuf_iterator<char>(file), istreambuf_iterator<char>()));
+    for (size_t i = 0; i < max(expected.size(), actual.size()); ++i) {
+        if (i >= expected.size() || i >= actual.size()) {
+            cerr << path << ": " << actual.size() << " telegrams, expected " << expected.size() << "\n";
+            return false;
+        }
+        if (expected[i] != actual[i]) {
+            cerr << path << ": telegram " << i + 1 << ", " << first_difference(expected[i], actual[i]) << "\n";
+            return false;
+        }
+    }
+    return true;
+}
+
+// The slicing path reads eight bytes per step; start it at every offset
+// from an 8 byte boundary
+static bool check_crc(const string& name, const vector<string>& telegrams) {
+    alignas(8) static char buffer[TelegramFramer::capacity + 8];
+    for (size_t i = 0; i < telegrams.size(); ++i) {
+        string_view body(telegrams[i]);
+        body = body.substr(0, body.rfind('!') + 1);
+        unsigned short expected = crc16_reference(body);
+        for (size_t offset = 0; offset < 8; ++offset) {
+            memcpy(buffer + offset, body.data(), body.size());
+            if (Crc16::ComputeChecksum(reinterpret_cast<const unsigned char*>(buffer + offset), body.size()) != expected) {
+                cerr << name << ": telegram " << i + 1 << ", CRC differs from the reference at offset " << offset << "\n";
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+static void write_file(const string& path, const vector<string>& telegrams) {
+    ofstream file(path, ios::binary);
+    file << join(telegrams);
+    file.close();
+    if (!file) throw runtime_error("Cannot write " + path);
+}
+
+int main(int argc, char* argv[]) {
+    try {
+        Options options;
+        try {
+            options = parse_options(argc, argv);
+        } catch (const exception& e) {
+            cerr << e.what() << endl;
+            usage(argv[0]);
+            return 1;
+        }
+
+        bool same = true;
+        for (const string& capture : options.captures) {
+            size_t slash = capture.rfind('/');
+            string name = slash == string::npos ? capture : capture.substr(slash + 1);
+            string base = options.expected_dir + "/" + name.substr(0, name.rfind(".p1cap"));
+            Output output = replay(capture);
+            bool stream_same = output.stream_difference.empty();
+            if (!stream_same) cerr << name << ": encoder differs from the stream reference, " << output.stream_difference << "\n";
+            if (options.update) {
+                write_file(base + ".rebuild", output.rebuild);
+                write_file(base + ".patch", output.patch);
+                cout << name << ": " << output.patch.size() << " telegrams written\n";
+                same = same && stream_same;
+            } else {
+                bool rebuild_same = compare(base + ".rebuild", output.rebuild);
+                bool patch_same = compare(base + ".patch", output.patch);
+                bool crc_same = check_crc(name, output.patch);
+                bool all_same = rebuild_same && patch_same && crc_same && stream_same;
+                if (all_same) cout << name << ": " << output.patch.size() << " telegrams ok\n";
+                same = same && all_same;
+            }
+        }
+        return same ? 0 : 1;
+    }
+    catch (const exception& e) {
+        cerr << "Exception: " << e.what() << endl;
+        return 1;
+    }
+}
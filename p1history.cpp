@@ -0,0 +1,249 @@
+// Queries the history file written by `laadpaal --history=<file>`.
+//
+//   p1history [--from=<time>] [--to=<time>] [--tier=raw|minute|quarter] [--fields=<a,b,...>] <file>
+//   p1history --info <file>
+//
+// Times are "now", Unix seconds, an offset from now ("-90s", "-15m", "-2h",
+// "-7d") or UTC as "2024-06-12T12:30[:00][Z]". The default range is the last
+// hour. Output is CSV with a UTC timestamp in front; minute and quarter rows
+// give average, minimum and maximum of each gauge, and the counter at the
+// end of the period with its increase over the period.
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "p1_history.h"
+
+using namespace std;
+using namespace p1_history;
+
+struct Options {
+    string path;
+    string from = "-1h";
+    string to = "now";
+    string tier = "raw";
+    string fields;
+    bool info = false;
+};
+
+static void usage(const char* name) {
+    cerr << "Usage: " << name << " [--from=<time>] [--to=<time>] [--tier=raw|minute|quarter] [--fields=<a,b,...>] <file>\n"
+         << "       " << name << " --info <file>\n"
+         << "Times: now, <unix seconds>, -<n>s|m|h|d, or UTC <yyyy-mm-dd>T<hh:mm>[:<ss>][Z]\n";
+}
+
+static Options parse_options(int argc, char* argv[]) {
+    Options options;
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg == "--info") options.info = true;
+        else if (arg.compare(0, 7, "--from=") == 0) options.from = arg.substr(7);
+        else if (arg.compare(0, 5, "--to=") == 0) options.to = arg.substr(5);
+        else if (arg.compare(0, 7, "--tier=") == 0) options.tier = arg.substr(7);
+        else if (arg.compare(0, 9, "--fields=") == 0) options.fields = arg.substr(9);
+        else if (arg.compare(0, 2, "--") == 0) throw invalid_argument("Unknown option " + arg);
+        else if (options.path.empty()) options.path = arg;
+        else throw invalid_argument("Unexpected argument " + arg);
+    }
+    if (options.path.empty()) throw invalid_argument("No history file given");
+    if (options.tier != "raw" && options.tier != "minute" && options.tier != "quarter") {
+        throw invalid_argument("Invalid tier " + options.tier);
+    }
+    return options;
+}
+
+static int64_t now_ms() {
+    return chrono::duration_cast<chrono::milliseconds>(chrono::system_clock::now().time_since_epoch()).count();
+}
+
+static int64_t parse_time(const string& text) {
+    if (text == "now") return now_ms();
+    if (!text.empty() && text[0] == '-') {
+        size_t used;
+        double amount = stod(text.substr(1), &used);
+        string unit = text.substr(1 + used);
+        double seconds = unit == "s" ? 1 : unit == "m" ? 60 : unit == "h" ? 3600 : unit == "d" ? 86400 : 0;
+        if (seconds == 0) throw invalid_argument("Invalid time " + text);
+        return now_ms() - static_cast<int64_t>(amount * seconds * 1000);
+    }
+    if (text.find('-') == string::npos) return stoll(text) * 1000;
+    tm parts = {};
+    int seconds = 0;
+    if (sscanf(text.c_str(), "%d-%d-%dT%d:%d:%d", &parts.tm_year, &parts.tm_mon, &parts.tm_mday,
+               &parts.tm_hour, &parts.tm_min, &seconds) < 5) {
+        throw invalid_argument("Invalid time " + text);
+    }
+    parts.tm_year -= 1900;
+    parts.tm_mon -= 1;
+    parts.tm_sec = seconds;
+    return static_cast<int64_t>(timegm(&parts)) * 1000;
+}
+
+static string format_time(int64_t time_ms) {
+    time_t seconds = static_cast<time_t>(time_ms / 1000);
+    tm parts;
+    gmtime_r(&seconds, &parts);
+    char text[32];
+    size_t length = strftime(text, sizeof(text), "%Y-%m-%dT%H:%M:%S", &parts);
+    snprintf(text + length, sizeof(text) - length, ".%03dZ", static_cast<int>(time_ms % 1000));
+    return text;
+}
+
+// Columns of the output, in schema order
+static vector<Obis> select_fields(const string& names, uint64_t seen) {
+    vector<Obis> fields;
+    if (names.empty()) {
+        for (Obis id : gauge_columns) if (seen & (uint64_t(1) << static_cast<size_t>(id))) fields.push_back(id);
+        for (Obis id : counter_columns) if (seen & (uint64_t(1) << static_cast<size_t>(id))) fields.push_back(id);
+        sort(fields.begin(), fields.end());
+        return fields;
+    }
+    istringstream stream(names);
+    string name;
+    while (getline(stream, name, ',')) {
+        size_t i = 0;
+        while (i < obis_field_count && name != obis_schema[i].name) ++i;
+        Obis id = static_cast<Obis>(i);
+        if (i == obis_field_count || (find(gauge_columns.begin(), gauge_columns.end(), id) == gauge_columns.end() &&
+                                      find(counter_columns.begin(), counter_columns.end(), id) == counter_columns.end())) {
+            throw invalid_argument("No history for field " + name);
+        }
+        fields.push_back(id);
+    }
+    return fields;
+}
+
+static size_t column_of(const Obis* first, const Obis* last, Obis id) {
+    return find(first, last, id) - first;
+}
+
+static bool is_gauge(Obis id) {
+    return column_of(gauge_columns.begin(), gauge_columns.end(), id) < gauge_count;
+}
+
+static void print_number(double value, int decimals) {
+    if (std::isnan(value)) return;
+    printf("%.*f", decimals, value);
+}
+
+static void query_raw(const HistoryReader& reader, const Options& options, int64_t from, int64_t to) {
+    uint64_t seen = 0;
+    if (options.fields.empty()) reader.raw(from, to, [&](const RawRow& row) { seen |= row.seen; });
+    vector<Obis> fields = select_fields(options.fields, seen);
+
+    printf("time");
+    for (Obis id : fields) printf(",%s", schema_of(id).name);
+    printf("\n");
+    reader.raw(from, to, [&](const RawRow& row) {
+        printf("%s", format_time(row.time_ms).c_str());
+        for (Obis id : fields) {
+            printf(",");
+            if (row.seen & (uint64_t(1) << static_cast<size_t>(id))) print_number(row.value(id), schema_of(id).decimals);
+        }
+        printf("\n");
+    });
+}
+
+static void query_aggregates(const HistoryReader& reader, const Options& options, int64_t from, int64_t to) {
+    bool minutes = options.tier == "minute";
+    auto each = [&](auto&& handler) {
+        if (minutes) reader.minutes(from, to, handler);
+        else reader.quarters(from, to, handler);
+    };
+    uint64_t seen = 0;
+    if (options.fields.empty()) each([&](const AggregateRow& row) { seen |= row.seen; });
+    vector<Obis> fields = select_fields(options.fields, seen);
+
+    printf("time,samples");
+    for (Obis id : fields) {
+        const char* name = schema_of(id).name;
+        if (is_gauge(id)) printf(",%s_avg,%s_min,%s_max", name, name, name);
+        else printf(",%s,%s_increase", name, name);
+    }
+    printf("\n");
+    bool first = true;
+    int64_t previous[counter_count] = {};
+    each([&](const AggregateRow& row) {
+        printf("%s,%u", format_time(row.start_ms).c_str(), row.samples);
+        for (Obis id : fields) {
+            int decimals = schema_of(id).decimals;
+            if (is_gauge(id)) {
+                size_t g = column_of(gauge_columns.begin(), gauge_columns.end(), id);
+                if (row.count[g] == 0) {
+                    printf(",,,");
+                    continue;
+                }
+                printf(",");
+                print_number(row.sum[g] / row.count[g], decimals);
+                printf(",");
+                print_number(row.min[g], decimals);
+                printf(",");
+                print_number(row.max[g], decimals);
+            } else {
+                size_t c = column_of(counter_columns.begin(), counter_columns.end(), id);
+                double scale = counter_scale(id);
+                printf(",");
+                print_number(row.last[c] / scale, decimals);
+                printf(",");
+                if (!first) print_number((row.last[c] - previous[c]) / scale, decimals);
+            }
+        }
+        printf("\n");
+        memcpy(previous, row.last, sizeof(previous));
+        first = false;
+    });
+}
+
+static void info(const HistoryReader& reader) {
+    const FileHeader& file = reader.file().header();
+    int64_t oldest = 0, newest = 0;
+    uint64_t rows = 0;
+    reader.raw(numeric_limits<int64_t>::min(), numeric_limits<int64_t>::max(), [&](const RawRow& row) {
+        if (rows++ == 0) oldest = row.time_ms;
+        newest = row.time_ms;
+    });
+    cout << "File size:      " << reader.file().size() / (1024 * 1024) << " MiB\n"
+         << "Raw:            " << rows << " rows in " << min(file.blocks_started.load(), file.block_count)
+         << " of " << file.block_count << " blocks";
+    if (rows) cout << ", " << format_time(oldest) << " to " << format_time(newest);
+    cout << "\nMinute rows:    " << min(file.minute_rows.load(), file.minute_capacity) << " of " << file.minute_capacity
+         << "\nQuarter rows:   " << min(file.quarter_rows.load(), file.quarter_capacity) << " of " << file.quarter_capacity
+         << "\nColumns:        " << gauge_count << " gauges, " << counter_count << " counters\n";
+}
+
+int main(int argc, char* argv[]) {
+    try {
+        Options options;
+        int64_t from, to;
+        try {
+            options = parse_options(argc, argv);
+            from = parse_time(options.from);
+            to = parse_time(options.to);
+        } catch (const exception& e) {
+            cerr << e.what() << endl;
+            usage(argv[0]);
+            return 1;
+        }
+
+        HistoryReader reader(options.path);
+        if (options.info) info(reader);
+        else if (options.tier == "raw") query_raw(reader, options, from, to);
+        else query_aggregates(reader, options, from, to);
+    }
+    catch (const exception& e) {
+        cerr << "Exception: " << e.what() << endl;
+        return 1;
+    }
+
+    return 0;
+}
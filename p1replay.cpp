@@ -0,0 +1,308 @@
+// Replays a P1 capture into a pseudo-terminal and collects what comes out of
+// a second one, so laadpaal can be load tested without a meter or adapters.
+//
+//   p1replay [options] <capture> -- ./laadpaal {meter} 115200 {charger} 115200 ...
+//
+// {meter} and {charger} in the command are replaced by the pty paths. Without
+// a command the paths are printed and replay starts once Enter is pressed.
+
+#include <pty.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "crc16.h"
+#include "p1_capture.h"
+
+using namespace std;
+using Clock = chrono::steady_clock;
+
+struct Pty {
+    int master = -1;
+    int slave = -1;
+    string path;
+
+    Pty() {
+        char name[128];
+        if (openpty(&master, &slave, name, nullptr, nullptr) != 0) {
+            throw runtime_error(string("openpty failed: ") + strerror(errno));
+        }
+        path = name;
+        termios settings;
+        tcgetattr(slave, &settings);
+        cfmakeraw(&settings);
+        tcsetattr(slave, TCSANOW, &settings);
+    }
+
+    ~Pty() {
+        close(master);
+        close(slave);
+    }
+};
+
+// Finds telegram ends ("!" line terminated by '\n') in a byte stream and
+// checks their CRC when there is one.
+class TelegramTracker {
+public:
+    // Returns the number of telegrams that ended in this chunk and calls
+    // on_telegram with the timestamp line (0-0:1.0.0) of each, empty if it
+    // has none
+    template <typename Handler>
+    size_t feed(const char* data, size_t length, Handler&& on_telegram) {
+        size_t completed = 0;
+        for (size_t i = 0; i < length; ++i) {
+            char c = data[i];
+            if (c == '/') {
+                telegram_.clear();
+                in_telegram_ = true;
+            }
+            if (!in_telegram_) continue;
+            telegram_.push_back(c);
+            if (c == '\n' && telegram_.size() > 1) {
+                size_t line = telegram_.rfind('\n', telegram_.size() - 2);
+                line = line == string::npos ? 0 : line + 1;
+                if (telegram_[line] == '!') {
+                    check(line);
+                    in_telegram_ = false;
+                    ++completed;
+                    on_telegram(timestamp());
+                }
+            }
+        }
+        return completed;
+    }
+
+    uint64_t crc_errors = 0;
+
+private:
+    void check(size_t bang) {
+        string_view trailer(telegram_.data() + bang + 1, telegram_.size() - bang - 1);
+        if (trailer.size() < 6) return;  // DSMR 2.2/3, no checksum
+        unsigned short expected = 0;
+        auto result = from_chars(trailer.data(), trailer.data() + 4, expected, 16);
+        if (result.ptr != trailer.data() + 4 || Crc16::ComputeChecksum(string_view(telegram_.data(), bang + 1)) != expected) {
+            ++crc_errors;
+        }
+    }
+
+    // Passthrough keeps it as the meter sent it and a rebuild copies it, so
+    // it identifies the meter telegram an output telegram came from
+    string_view timestamp() const {
+        size_t start = telegram_.find("\n0-0:1.0.0(");
+        if (start == string::npos) return string_view();
+        size_t end = telegram_.find('\r', start + 1);
+        return string_view(telegram_).substr(start + 1, end == string::npos ? string::npos : end - start - 1);
+    }
+
+    string telegram_;
+    bool in_telegram_ = false;
+};
+
+struct Options {
+    double speed = 1.0;  // 0 means as fast as possible
+    int loops = 1;
+    int start_delay_ms = 1000;
+    int settle_ms = 2000;
+    string output_path;
+    string capture_path;
+    vector<string> command;
+};
+
+static void usage(const char* name) {
+    cerr << "Usage: " << name << " [--speed=<factor>|max] [--loop=<count>] [--start-delay=<ms>] [--settle=<ms>]\n"
+         << "       [--output=<file>] <capture> [-- <command with {meter} and {charger}>]\n";
+}
+
+static Options parse_options(int argc, char* argv[]) {
+    Options options;
+    int i = 1;
+    for (; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg == "--") {
+            ++i;
+            break;
+        }
+        if (arg == "--speed=max") options.speed = 0;
+        else if (arg.compare(0, 8, "--speed=") == 0) options.speed = stod(arg.substr(8));
+        else if (arg.compare(0, 7, "--loop=") == 0) options.loops = stoi(arg.substr(7));
+        else if (arg.compare(0, 14, "--start-delay=") == 0) options.start_delay_ms = stoi(arg.substr(14));
+        else if (arg.compare(0, 9, "--settle=") == 0) options.settle_ms = stoi(arg.substr(9));
+        else if (arg.compare(0, 9, "--output=") == 0) options.output_path = arg.substr(9);
+        else if (arg.compare(0, 2, "--") == 0) throw invalid_argument("Unknown option " + arg);
+        else if (options.capture_path.empty()) options.capture_path = arg;
+        else throw invalid_argument("Unexpected argument " + arg);
+    }
+    for (; i < argc; ++i) options.command.push_back(argv[i]);
+    if (options.capture_path.empty()) throw invalid_argument("No capture file given");
+    if (options.speed < 0) throw invalid_argument("Invalid speed");
+    return options;
+}
+
+static pid_t spawn(const vector<string>& command, const Pty& meter, const Pty& charger) {
+    vector<string> expanded;
+    for (string arg : command) {
+        for (auto& placeholder : {make_pair(string("{meter}"), meter.path), make_pair(string("{charger}"), charger.path)}) {
+            size_t pos;
+            while ((pos = arg.find(placeholder.first)) != string::npos) arg.replace(pos, placeholder.first.size(), placeholder.second);
+        }
+        expanded.push_back(arg);
+    }
+    vector<char*> args;
+    for (auto& arg : expanded) args.push_back(&arg[0]);
+    args.push_back(nullptr);
+
+    pid_t pid = fork();
+    if (pid < 0) throw runtime_error(string("fork failed: ") + strerror(errno));
+    if (pid == 0) {
+        execvp(args[0], args.data());
+        cerr << "Cannot start " << args[0] << ": " << strerror(errno) << endl;
+        _exit(127);
+    }
+    return pid;
+}
+
+static double percentile(vector<double> values, double fraction) {
+    if (values.empty()) return 0;
+    sort(values.begin(), values.end());
+    return values[min(values.size() - 1, static_cast<size_t>(fraction * values.size()))];
+}
+
+int main(int argc, char* argv[]) {
+    try {
+        Options options;
+        try {
+            options = parse_options(argc, argv);
+        } catch (const exception& e) {
+            cerr << e.what() << endl;
+            usage(argv[0]);
+            return 1;
+        }
+
+        p1_capture::Reader capture(options.capture_path);
+        Pty meter;
+        Pty charger;
+
+        pid_t child = -1;
+        if (options.command.empty()) {
+            cout << "Meter side:   " << meter.path << "\nCharger side: " << charger.path
+                 << "\nPress Enter to start the replay" << endl;
+            string line;
+            getline(cin, line);
+        } else {
+            child = spawn(options.command, meter, charger);
+            this_thread::sleep_for(chrono::milliseconds(options.start_delay_ms));
+        }
+
+        // Collect the charger side on its own thread so a slow consumer never
+        // delays the replay timing
+        mutex lock;
+        // Input telegrams by timestamp line, until an output telegram with
+        // the same timestamp arrives: output may lag behind the input or
+        // skip telegrams, so the latest input is not the one it came from
+        unordered_map<string, Clock::time_point> input_ends;
+        vector<double> latencies_ms;
+        TelegramTracker output_tracker;
+        atomic<bool> collecting(true);
+        uint64_t telegrams_in = 0;
+        uint64_t bytes_out = 0;
+        uint64_t telegrams_out = 0;
+        ofstream output;
+        if (!options.output_path.empty()) output.open(options.output_path, ios::binary);
+
+        thread collector([&] {
+            char data[4096];
+            while (collecting) {
+                pollfd descriptor = {charger.master, POLLIN, 0};
+                if (poll(&descriptor, 1, 50) <= 0) continue;
+                ssize_t length = read(charger.master, data, sizeof(data));
+                if (length <= 0) continue;
+                Clock::time_point now = Clock::now();
+                lock_guard<mutex> guard(lock);
+                bytes_out += length;
+                if (output.is_open()) output.write(data, length);
+                telegrams_out += output_tracker.feed(data, length, [&](string_view timestamp) {
+                    auto input = input_ends.find(string(timestamp));
+                    // Later than now: the next loop over the capture has
+                    // written the same telegram again, for an output still to come
+                    if (timestamp.empty() || input == input_ends.end() || input->second > now) return;
+                    latencies_ms.push_back(chrono::duration<double, milli>(now - input->second).count());
+                    input_ends.erase(input);
+                });
+            }
+        });
+
+        TelegramTracker input_tracker;
+        uint64_t bytes_in = 0;
+        p1_capture::Record record;
+        Clock::time_point start = Clock::now();
+        Clock::time_point due = start;
+        for (int loop = 0; loop < options.loops; ++loop) {
+            capture.rewind();
+            while (capture.next(record)) {
+                if (options.speed > 0) {
+                    due += chrono::duration_cast<Clock::duration>(chrono::microseconds(record.delta_us) / options.speed);
+                    this_thread::sleep_until(due);
+                }
+                size_t written = 0;
+                while (written < record.data.size()) {
+                    ssize_t result = write(meter.master, record.data.data() + written, record.data.size() - written);
+                    if (result < 0) {
+                        if (errno == EINTR) continue;
+                        throw runtime_error(string("write to meter pty failed: ") + strerror(errno));
+                    }
+                    written += result;
+                }
+                bytes_in += record.data.size();
+                Clock::time_point now = Clock::now();
+                lock_guard<mutex> guard(lock);
+                telegrams_in += input_tracker.feed(record.data.data(), record.data.size(), [&](string_view timestamp) {
+                    if (!timestamp.empty()) input_ends[string(timestamp)] = now;
+                });
+            }
+        }
+        Clock::time_point replay_end = Clock::now();
+
+        this_thread::sleep_for(chrono::milliseconds(options.settle_ms));
+        collecting = false;
+        collector.join();
+        if (child > 0) {
+            kill(child, SIGTERM);
+            waitpid(child, nullptr, 0);
+        }
+
+        double seconds = chrono::duration<double>(replay_end - start).count();
+        cout << "Replayed " << telegrams_in << " telegrams (" << bytes_in << " bytes) in " << seconds << " s, "
+             << (seconds > 0 ? telegrams_in / seconds : 0) << " telegrams/s\n"
+             << "Received " << telegrams_out << " telegrams (" << bytes_out << " bytes), "
+             << output_tracker.crc_errors << " with a bad CRC\n";
+        if (!latencies_ms.empty()) {
+            cout << "Latency (ms) from input telegram to the output telegram with its timestamp, " << latencies_ms.size()
+                 << " paired: p50 " << percentile(latencies_ms, 0.50) << ", p90 " << percentile(latencies_ms, 0.90)
+                 << ", p99 " << percentile(latencies_ms, 0.99) << ", max " << percentile(latencies_ms, 1.0) << "\n";
+        }
+    }
+    catch (const exception& e) {
+        cerr << "Exception: " << e.what() << endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,300 @@
+// Test bench for the current controller: drives it with a household load
+// profile and a simple model of the charger, and compares it with the fixed
+// step controller laadpaal used before.
+//
+//   p1sim [options] <profile.csv>
+//
+// A profile has one row per change, values are held until the next row:
+//     seconds,load_l1,load_l2,load_l3,solar_l1,solar_l2,solar_l3
+// with all currents in A. Lines starting with '#' are comments.
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "current_controller.h"
+
+using namespace std;
+
+struct ProfileRow {
+    double seconds;
+    array<double, 3> load;
+    array<double, 3> solar;
+};
+
+struct Options {
+    string profile_path;
+    string trace_path;
+    ControllerSettings controller;
+    double current_limit = 16;
+    double interval = 1;       // Seconds between telegrams, 10 for DSMR 4
+    double voltage = 230;
+    double charger_tau = 3;    // Time constant of the charger following its headroom
+    double min_current = 6;    // Below this a car stops charging
+    double step = 2;           // Change in surplus (A) that starts a new event
+    double tolerance = 1;      // Settled once within this many A of the target
+};
+
+static void usage(const char* name) {
+    cerr << "Usage: " << name << " [--phases=1|3] [--limit=<A>] [--kp=<A/A>] [--ki=<A/A/s>] [--control-period=<s>]\n"
+         << "       [--phase-limits=<L1>,<L2>,<L3>] [--interval=<s>] [--voltage=<V>] [--charger-tau=<s>]\n"
+         << "       [--min-current=<A>] [--step=<A>] [--tolerance=<A>] [--trace=<file>] <profile.csv>\n";
+}
+
+static Options parse_options(int argc, char* argv[]) {
+    Options options;
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg == "--phases=1") options.controller.three_phases = false;
+        else if (arg == "--phases=3") options.controller.three_phases = true;
+        else if (arg.compare(0, 8, "--limit=") == 0) options.current_limit = stod(arg.substr(8));
+        else if (arg.compare(0, 5, "--kp=") == 0) options.controller.kp = stod(arg.substr(5));
+        else if (arg.compare(0, 5, "--ki=") == 0) options.controller.ki = stod(arg.substr(5));
+        else if (arg.compare(0, 17, "--control-period=") == 0) options.controller.period = stod(arg.substr(17));
+        else if (arg.compare(0, 15, "--phase-limits=") == 0) {
+            istringstream stream(arg.substr(15));
+            string part;
+            for (double& limit : options.controller.limits) {
+                if (!getline(stream, part, ',')) throw invalid_argument("Expected three phase limits in " + arg);
+                limit = stod(part);
+            }
+        }
+        else if (arg.compare(0, 11, "--interval=") == 0) options.interval = stod(arg.substr(11));
+        else if (arg.compare(0, 10, "--voltage=") == 0) options.voltage = stod(arg.substr(10));
+        else if (arg.compare(0, 14, "--charger-tau=") == 0) options.charger_tau = stod(arg.substr(14));
+        else if (arg.compare(0, 14, "--min-current=") == 0) options.min_current = stod(arg.substr(14));
+        else if (arg.compare(0, 7, "--step=") == 0) options.step = stod(arg.substr(7));
+        else if (arg.compare(0, 12, "--tolerance=") == 0) options.tolerance = stod(arg.substr(12));
+        else if (arg.compare(0, 8, "--trace=") == 0) options.trace_path = arg.substr(8);
+        else if (arg.compare(0, 2, "--") == 0) throw invalid_argument("Unknown option " + arg);
+        else if (options.profile_path.empty()) options.profile_path = arg;
+        else throw invalid_argument("Unexpected argument " + arg);
+    }
+    if (options.profile_path.empty()) throw invalid_argument("No profile given");
+    if (options.interval <= 0) throw invalid_argument("Invalid interval");
+    apply_current_limit(options.controller, options.current_limit);
+    return options;
+}
+
+static vector<ProfileRow> read_profile(const string& path) {
+    ifstream file(path);
+    if (!file) throw runtime_error("Cannot open profile " + path);
+    vector<ProfileRow> rows;
+    string line;
+    int number = 0;
+    while (getline(file, line)) {
+        ++number;
+        if (line.empty() || line[0] == '#' || isalpha(static_cast<unsigned char>(line[0]))) continue;
+        istringstream stream(line);
+        ProfileRow row;
+        char comma;
+        stream >> row.seconds;
+        for (double& value : row.load) stream >> comma >> value;
+        for (double& value : row.solar) stream >> comma >> value;
+        if (!stream) throw invalid_argument(path + ":" + to_string(number) + ": expected 7 comma separated numbers");
+        if (!rows.empty() && row.seconds < rows.back().seconds) {
+            throw invalid_argument(path + ":" + to_string(number) + ": time goes backwards");
+        }
+        rows.push_back(row);
+    }
+    if (rows.empty()) throw invalid_argument(path + " has no rows");
+    return rows;
+}
+
+// The controller laadpaal had before: every 10 s all phases move by the total
+// meter current (a third of it for a three-phase car), towards more headroom
+// when the house delivers and towards less when it imports.
+class FixedStepController {
+public:
+    FixedStepController(const ControllerSettings& settings, double current_limit)
+        : three_phases_(settings.three_phases), current_limit_(current_limit) {}
+
+    bool update(const array<PhaseMeasurement, 3>& phases, double now) {
+        if (has_updated_ && now - last_update_ < 10) return false;
+        has_updated_ = true;
+        last_update_ = now;
+        double consumption = 0, generation = 0, current = 0;
+        for (const PhaseMeasurement& phase : phases) {
+            consumption += phase.consumption;
+            generation += phase.generation;
+            current += min(phase.current, current_limit_);
+        }
+        double step = three_phases_ ? current / 3 : current;
+        for (double& output : output_) {
+            if (consumption - generation > 0) output -= step;
+            else if (consumption - generation < 0) output += step;
+            output = max(0.0, min(output, current_limit_));
+        }
+        return true;
+    }
+
+    const array<double, 3>& output() const {
+        return output_;
+    }
+
+private:
+    bool three_phases_;
+    double current_limit_;
+    array<double, 3> output_ = {{0, 0, 0}};
+    double last_update_ = 0;
+    bool has_updated_ = false;
+};
+
+struct Result {
+    double import_kwh = 0;
+    double export_kwh = 0;
+    double charged_kwh = 0;
+    size_t events = 0;
+    size_t unsettled = 0;
+    vector<double> settling;
+    vector<double> overshoot;
+};
+
+// One step change in the surplus and how the charger followed it
+struct Event {
+    double start;
+    bool upwards;
+    double last_outside = -1;  // Last time the charger was outside the tolerance
+    double overshoot = 0;
+};
+
+template <typename Controller>
+static Result simulate(const Options& options, const vector<ProfileRow>& profile, Controller controller, ostream* trace) {
+    const bool three_phases = options.controller.three_phases;
+    const double dt = options.interval;
+    const double follow = 1 - exp(-dt / options.charger_tau);
+    array<double, 3> charger = {{0, 0, 0}};
+    double previous_wanted = 0;
+    vector<Event> events;
+    Result result;
+
+    auto close_event = [&](double end) {
+        if (events.empty()) return;
+        Event& event = events.back();
+        result.overshoot.push_back(event.overshoot);
+        // Still outside at the end of the window: it never settled
+        if (event.last_outside >= end - dt) ++result.unsettled;
+        else result.settling.push_back(event.last_outside < 0 ? 0 : event.last_outside + dt - event.start);
+    };
+
+    size_t row = 0;
+    double end = profile.back().seconds;
+    for (double now = 0; now <= end; now += dt) {
+        while (row + 1 < profile.size() && profile[row + 1].seconds <= now) ++row;
+        const ProfileRow& values = profile[row];
+
+        // What an ideal controller would let the car draw
+        array<double, 3> available;
+        for (size_t i = 0; i < 3; ++i) {
+            available[i] = max(0.0, min(values.solar[i] - values.load[i], options.controller.limits[i]));
+        }
+        double wanted = three_phases ? min({available[0], available[1], available[2]}) : available[0];
+        if (wanted < options.min_current) wanted = 0;
+        if (abs(wanted - previous_wanted) >= options.step) {
+            close_event(now);
+            events.push_back({now, wanted > previous_wanted});
+        }
+        previous_wanted = wanted;
+
+        // The meter sees the house, the solar inverter and the car
+        array<PhaseMeasurement, 3> phases;
+        for (size_t i = 0; i < 3; ++i) {
+            double net = values.load[i] + charger[i] - values.solar[i];
+            phases[i].current = round(abs(net));
+            phases[i].consumption = round(max(net, 0.0) * options.voltage) / 1000;
+            phases[i].generation = round(max(-net, 0.0) * options.voltage) / 1000;
+            phases[i].voltage = options.voltage;
+            result.import_kwh += phases[i].consumption * dt / 3600;
+            result.export_kwh += phases[i].generation * dt / 3600;
+            result.charged_kwh += charger[i] * options.voltage / 1000 * dt / 3600;
+        }
+        controller.update(phases, now);
+
+        if (!events.empty()) {
+            Event& event = events.back();
+            double drawn = charger[0];
+            if (abs(drawn - wanted) > options.tolerance) event.last_outside = now;
+            event.overshoot = max(event.overshoot, event.upwards ? drawn - wanted : wanted - drawn);
+        }
+        if (trace) {
+            *trace << now;
+            for (size_t i = 0; i < 3; ++i) *trace << ',' << CurrentController::surplus(phases[i]);
+            *trace << ',' << wanted << ',' << controller.output()[0] << ',' << charger[0] << '\n';
+        }
+
+        // The charger moves towards its headroom, but a car does not charge
+        // below its minimum current
+        for (size_t i = 0; i < 3; ++i) {
+            double target = three_phases || i == 0 ? controller.output()[i] : 0;
+            if (target < options.min_current) target = 0;
+            charger[i] += (target - charger[i]) * follow;
+        }
+    }
+    close_event(end);
+    result.events = events.size();
+    return result;
+}
+
+static double mean(const vector<double>& values) {
+    double sum = 0;
+    for (double value : values) sum += value;
+    return values.empty() ? 0 : sum / values.size();
+}
+
+static double maximum(const vector<double>& values) {
+    return values.empty() ? 0 : *max_element(values.begin(), values.end());
+}
+
+static void report(const string& name, const Result& result) {
+    cout << left << setw(12) << name << right << fixed << setprecision(1)
+         << setw(8) << result.events << setw(9) << result.unsettled
+         << setw(13) << mean(result.settling) << setw(12) << maximum(result.settling)
+         << setw(15) << mean(result.overshoot) << setw(15) << maximum(result.overshoot)
+         << setprecision(3) << setw(12) << result.import_kwh << setw(12) << result.export_kwh
+         << setw(13) << result.charged_kwh << "\n";
+}
+
+int main(int argc, char* argv[]) {
+    try {
+        Options options;
+        try {
+            options = parse_options(argc, argv);
+        } catch (const exception& e) {
+            cerr << e.what() << endl;
+            usage(argv[0]);
+            return 1;
+        }
+
+        vector<ProfileRow> profile = read_profile(options.profile_path);
+        ofstream trace;
+        if (!options.trace_path.empty()) {
+            trace.open(options.trace_path);
+            trace << "seconds,surplus_l1,surplus_l2,surplus_l3,wanted,headroom_l1,charger_l1\n";
+        }
+
+        Result pi = simulate(options, profile, CurrentController(options.controller), trace.is_open() ? &trace : nullptr);
+        Result fixed_step = simulate(options, profile, FixedStepController(options.controller, options.current_limit), nullptr);
+
+        cout << profile.back().seconds << " s, " << (options.controller.three_phases ? 3 : 1) << " phase car, telegram every "
+             << options.interval << " s, kp " << options.controller.kp << ", ki " << options.controller.ki << "\n\n"
+             << left << setw(12) << "controller" << right << setw(8) << "events" << setw(9) << "never"
+             << setw(13) << "settle avg" << setw(12) << "settle max" << setw(15) << "overshoot avg" << setw(15) << "overshoot max"
+             << setw(12) << "import kWh" << setw(12) << "export kWh" << setw(13) << "charged kWh" << "\n";
+        report("pi", pi);
+        report("fixed step", fixed_step);
+        cout << "\nSettling in s to within " << options.tolerance << " A of the available surplus, overshoot in A\n";
+    }
+    catch (const exception& e) {
+        cerr << "Exception: " << e.what() << endl;
+        return 1;
+    }
+
+    return 0;
+}
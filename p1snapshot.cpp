@@ -0,0 +1,215 @@
+// Reads the shared-memory snapshot published by `laadpaal --shm=<name>`.
+//
+//   p1snapshot [--follow] <name>
+//   p1snapshot --stress=<readers> [--duration=<s>] <name>
+//   p1snapshot --check=<publishes> [--stress=<readers>]
+//
+// --stress runs many readers in a tight loop against a live writer, for
+// example laadpaal fed by `p1replay --speed=max --loop=...`, and checks every
+// copy against the checksum the writer stored with it, so laadpaal has to run
+// with --shm-checksum. A torn copy would mean the seqlock is broken; the exit
+// code is 1 if one is found.
+//
+// --check does the same without laadpaal, for make check: it creates a
+// segment of its own and publishes that many snapshots, each with every
+// byte changed, as fast as it can while the readers check them.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+#include "p1_snapshot.h"
+
+using namespace std;
+using p1_snapshot::Snapshot;
+using p1_snapshot::SnapshotReader;
+using p1_snapshot::SnapshotWriter;
+
+struct Options {
+    string name;
+    bool follow = false;
+    unsigned readers = 0;
+    double duration = 10;
+    unsigned publishes = 0;  // --check
+};
+
+static void usage(const char* name) {
+    cerr << "Usage: " << name << " [--follow] <name>\n"
+         << "       " << name << " --stress=<readers> [--duration=<s>] <name>\n"
+         << "       " << name << " --check=<publishes> [--stress=<readers>]\n";
+}
+
+static Options parse_options(int argc, char* argv[]) {
+    Options options;
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg == "--follow") options.follow = true;
+        else if (arg.compare(0, 9, "--stress=") == 0) options.readers = stoul(arg.substr(9));
+        else if (arg.compare(0, 11, "--duration=") == 0) options.duration = stod(arg.substr(11));
+        else if (arg.compare(0, 8, "--check=") == 0) options.publishes = stoul(arg.substr(8));
+        else if (arg.compare(0, 2, "--") == 0) throw invalid_argument("Unknown option " + arg);
+        else if (options.name.empty()) options.name = arg;
+        else throw invalid_argument("Unexpected argument " + arg);
+    }
+    if (options.publishes) {
+        if (!options.name.empty()) throw invalid_argument("--check uses a segment of its own");
+        if (options.readers == 0) options.readers = 4;
+    } else if (options.name.empty()) {
+        throw invalid_argument("No snapshot name given");
+    }
+    return options;
+}
+
+static void print(const Snapshot& snapshot) {
+    double age = (chrono::duration_cast<chrono::nanoseconds>(chrono::system_clock::now().time_since_epoch()).count()
+                  - snapshot.time_ns) / 1e9;
+    const ObisValues& values = snapshot.values;
+    cout << "telegram " << snapshot.telegrams << ", " << fixed << setprecision(3) << age << " s ago";
+    if (!values.header().empty()) cout << ", meter " << values.header();
+    cout << "\n" << left << setw(26) << "setpoint (A)" << right;
+    for (double setpoint : snapshot.setpoints) cout << setw(8) << setpoint;
+    cout << "\n" << left << setw(26) << "reported current (A)" << right;
+    for (double reported : snapshot.reported) cout << setw(8) << reported;
+    cout << "\n";
+    for (size_t i = 0; i < obis_field_count; ++i) {
+        Obis id = static_cast<Obis>(i);
+        if (!values.seen(id)) continue;
+        const ObisSchemaEntry& entry = schema_of(id);
+        cout << left << setw(26) << entry.name << right;
+        switch (entry.type) {
+        case ObisType::number:
+        case ObisType::mbus:
+        case ObisType::mbus_legacy:
+            cout << setprecision(entry.decimals) << values.number(id);
+            if (entry.unit) cout << " " << entry.unit;
+            break;
+        case ObisType::integer:
+            cout << static_cast<long long>(values.number(id));
+            break;
+        case ObisType::text:
+        case ObisType::whole_text:
+            cout << values.text(id);
+            break;
+        }
+        cout << "\n";
+    }
+    cout << endl;
+}
+
+struct StressCounts {
+    atomic<uint64_t> reads{0}, retries{0}, torn{0}, backwards{0};
+};
+
+// Runs the readers against a checksumming writer until work() returns
+template <typename Work>
+static void read_while(const SnapshotReader& reader, unsigned readers, StressCounts& counts, Work&& work) {
+    if (!reader.checksummed()) throw runtime_error("The writer stores no checksums, start laadpaal with --shm-checksum");
+    atomic<bool> running(true);
+    vector<thread> threads;
+    for (unsigned i = 0; i < readers; ++i) {
+        threads.emplace_back([&] {
+            Snapshot snapshot;
+            uint64_t my_reads = 0, my_retries = 0, my_torn = 0, my_backwards = 0, last = 0;
+            while (running.load(memory_order_relaxed)) {
+                if (!reader.read(snapshot, &my_retries)) continue;
+                ++my_reads;
+                if (snapshot.checksum != p1_snapshot::checksum(snapshot)) ++my_torn;
+                if (snapshot.telegrams < last) ++my_backwards;
+                last = snapshot.telegrams;
+            }
+            counts.reads += my_reads;
+            counts.retries += my_retries;
+            counts.torn += my_torn;
+            counts.backwards += my_backwards;
+        });
+    }
+    work();
+    running = false;
+    for (thread& t : threads) t.join();
+}
+
+static int stress(const SnapshotReader& reader, const Options& options) {
+    StressCounts counts;
+    Snapshot first, last;
+    reader.read(first);
+    read_while(reader, options.readers, counts, [&] { this_thread::sleep_for(chrono::duration<double>(options.duration)); });
+    reader.read(last);
+
+    cout << options.readers << " readers, " << options.duration << " s: " << counts.reads << " reads ("
+         << static_cast<uint64_t>(counts.reads / options.duration) << "/s), " << counts.retries << " retries, "
+         << last.telegrams - first.telegrams << " telegrams published meanwhile\n"
+         << "Torn copies: " << counts.torn << ", sequence going backwards: " << counts.backwards << endl;
+    return counts.torn || counts.backwards ? 1 : 0;
+}
+
+// Every byte of the snapshot differs from the previous one, so a copy mixing
+// two publications always fails its checksum
+static int check(const Options& options) {
+    string name = "p1snapshot-check." + to_string(getpid());
+    SnapshotWriter writer(name, true);
+    auto fill = [](Snapshot& snapshot) {
+        uint64_t telegrams = snapshot.telegrams + 1;
+        std::memset(static_cast<void*>(&snapshot), static_cast<int>(telegrams & 0xFF), sizeof(Snapshot));
+        snapshot.telegrams = telegrams;
+    };
+    writer.publish(fill);
+    SnapshotReader reader(name);
+
+    StressCounts counts;
+    read_while(reader, options.readers, counts, [&] {
+        for (unsigned i = 1; i < options.publishes; ++i) {
+            writer.publish(fill);
+            // A gap as long as a copy, or the readers would mostly find the sequence odd
+            auto until = chrono::steady_clock::now() + chrono::microseconds(2);
+            while (chrono::steady_clock::now() < until) {}
+        }
+    });
+
+    cout << options.readers << " readers, " << options.publishes << " publishes: " << counts.reads << " reads, "
+         << counts.retries << " retries, torn copies: " << counts.torn << ", sequence going backwards: " << counts.backwards << endl;
+    if (thread::hardware_concurrency() == 1) cout << "One CPU: readers and writer never ran at the same time" << endl;
+    return counts.torn || counts.backwards ? 1 : 0;
+}
+
+int main(int argc, char* argv[]) {
+    try {
+        Options options;
+        try {
+            options = parse_options(argc, argv);
+        } catch (const exception& e) {
+            cerr << e.what() << endl;
+            usage(argv[0]);
+            return 1;
+        }
+
+        if (options.publishes) return check(options);
+        SnapshotReader reader(options.name);
+        if (options.readers) return stress(reader, options);
+
+        Snapshot snapshot;
+        uint64_t sequence = 0;
+        do {
+            if (reader.sequence() != sequence) {
+                sequence = reader.sequence();
+                if (reader.read(snapshot)) print(snapshot);
+                else if (!options.follow) cout << "Nothing published yet" << endl;
+            }
+            if (options.follow) this_thread::sleep_for(chrono::milliseconds(100));
+        } while (options.follow);
+    }
+    catch (const exception& e) {
+        cerr << "Exception: " << e.what() << endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,76 @@
+// Checks for corner cases of p1_pipeline.h that the captures in make check
+// never reach, each one a bug that was found and fixed:
+//
+//   p1test
+//
+// Prints every failed expectation and exits with 1 if there was one.
+
+#include <cstdio>
+#include <cstring>
+#include <initializer_list>
+#include <iostream>
+#include <string>
+
+#include "p1_pipeline.h"
+
+using namespace std;
+
+static int checks = 0;
+static int failures = 0;
+
+static void expect(bool condition, const string& what) {
+    ++checks;
+    if (!condition) {
+        cerr << "FAILED: " << what << "\n";
+        ++failures;
+    }
+}
+
+static void feed(TelegramFramer& framer, string_view bytes) {
+    auto space = framer.prepare();
+    size_t length = min(space.size(), bytes.size());
+    memcpy(space.data(), bytes.data(), length);
+    framer.commit(length);
+}
+
+// A frame that fills the whole buffer with its "!" in the last 6 bytes used
+// to stay buffered, leaving prepare() no room and the read loop spinning
+static void framer_full_buffer() {
+    for (string tail : {"!", "!AB", "!ABCD"}) {
+        TelegramFramer framer;
+        string frame = "/" + string(TelegramFramer::capacity - 1 - tail.size(), 'x') + tail;
+        feed(framer, frame);
+        string_view telegram;
+        expect(!framer.next(telegram), "full buffer ending in \"" + tail + "\" is no telegram");
+        expect(framer.stats().oversize == 1, "full buffer ending in \"" + tail + "\" counts as oversize");
+        expect(framer.prepare().size() == TelegramFramer::capacity, "full buffer ending in \"" + tail + "\" is dropped");
+
+        string valid = "/ISk5\\2MT382-1000\r\n\r\n1-0:1.8.1(000004.426*kWh)\r\n!";
+        char crc[8];
+        snprintf(crc, sizeof(crc), "%04X\r\n", Crc16::ComputeChecksum(valid));
+        feed(framer, valid + crc);
+        expect(framer.next(telegram) && telegram == valid + crc, "telegram after a dropped full buffer");
+    }
+}
+
+// The number used to run up to the next '*' or ')' anywhere in the
+// telegram, so a line missing both got the next line's reference overwritten
+static void patch_malformed_line() {
+    string telegram = "/ISk5\\2MT382-1000\r\n\r\n1-0:31.7.0(001\r\n1-0:51.7.0(002*A)\r\n!";
+    string original = telegram;
+    expect(!patch_obis_number(telegram, "1-0:31.7.0(", 16), "line without '*' or ')' is not patched");
+    expect(telegram == original, "line without '*' or ')' leaves the telegram alone");
+
+    expect(patch_obis_number(telegram, "1-0:51.7.0(", 16), "next line is still patched");
+    expect(telegram.find("1-0:51.7.0(016*A)\r\n") != string::npos, "next line holds the new value");
+
+    string unterminated = "/ISk5\\2MT382-1000\r\n\r\n1-0:31.7.0(001";
+    expect(!patch_obis_number(unterminated, "1-0:31.7.0(", 16), "line cut off at the end is not patched");
+}
+
+int main() {
+    framer_full_buffer();
+    patch_malformed_line();
+    if (failures == 0) cout << checks << " checks ok\n";
+    return failures == 0 ? 0 : 1;
+}
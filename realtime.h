@@ -0,0 +1,97 @@
+#pragma once
+
+// Settings for running the io threads with bounded latency on a shared or
+// memory-constrained gateway: memory locked so nothing on the hot path is
+// paged out, the io threads pinned to chosen cores and, if asked for, run
+// under SCHED_FIFO ahead of everything else on those cores.
+//
+// Failures throw: someone who asks for real-time behaviour wants to know
+// that they did not get it. SCHED_FIFO needs CAP_SYS_NICE (or an rtprio
+// limit), locking memory needs CAP_IPC_LOCK or a large enough memlock limit.
+
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+#include <cerrno>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace realtime {
+
+struct Settings {
+    bool lock_memory = false;
+    std::vector<int> cpus;  // Cores for the io threads; empty: wherever the kernel likes
+    int fifo_priority = 0;  // 1..99 for SCHED_FIFO; 0: normal scheduling
+};
+
+// "2" or "2,3"
+inline std::vector<int> parse_cpus(const std::string& text) {
+    std::vector<int> cpus;
+    std::istringstream stream(text);
+    std::string part;
+    while (std::getline(stream, part, ',')) {
+        int cpu = std::stoi(part);
+        if (cpu < 0 || cpu >= CPU_SETSIZE) throw std::invalid_argument("Invalid CPU " + part);
+        cpus.push_back(cpu);
+    }
+    if (cpus.empty()) throw std::invalid_argument("No CPUs in " + text);
+    return cpus;
+}
+
+// 1..99; 0 would mean normal scheduling, which is what leaving out the option gives
+inline int parse_fifo_priority(const std::string& text) {
+    int priority = std::stoi(text);
+    if (priority < 1 || priority > 99) throw std::invalid_argument("The SCHED_FIFO priority must be 1 to 99");
+    return priority;
+}
+
+// Touches the top of the calling thread's stack, where the handlers run,
+// so the first deep call chain does not fault. Under lock_memory() the
+// pages then stay locked.
+inline void prefault_stack() {
+    volatile char stack[256 * 1024];
+    for (size_t i = 0; i < sizeof(stack); i += 4096) stack[i] = 0;
+}
+
+// Locks what the process uses now and later. MCL_ONFAULT locks pages as
+// they are first touched, so mappings that are large but mostly unused,
+// such as thread stacks, do not have to fit in memory at once. Prefaults
+// the calling thread's stack; other threads call prefault_stack() themselves,
+// and buffers allocated ahead but not used yet go through lock_range().
+inline void lock_memory() {
+    if (mlockall(MCL_CURRENT | MCL_FUTURE | MCL_ONFAULT) != 0) {
+        throw std::runtime_error(std::string("Cannot lock memory: ") + std::strerror(errno));
+    }
+    prefault_stack();
+}
+
+// Faults in and locks a range now, without changing its contents, so the
+// first use of a buffer reserved at startup does not fault on the hot path
+inline void lock_range(const void* data, size_t size) {
+    if (size > 0 && mlock(data, size) != 0) {
+        throw std::runtime_error(std::string("Cannot lock memory: ") + std::strerror(errno));
+    }
+}
+
+// For the calling thread
+inline void apply_to_thread(const Settings& settings) {
+    if (!settings.cpus.empty()) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (int cpu : settings.cpus) CPU_SET(cpu, &set);
+        int error = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        if (error) throw std::runtime_error(std::string("Cannot pin io thread: ") + std::strerror(error));
+    }
+    if (settings.fifo_priority > 0) {
+        sched_param param{};
+        param.sched_priority = settings.fifo_priority;
+        int error = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+        if (error) throw std::runtime_error(std::string("Cannot switch io thread to SCHED_FIFO: ") + std::strerror(error));
+    }
+}
+
+} // namespace realtime
@@ -0,0 +1,178 @@
+#pragma once
+
+// Linux settings that decide how soon bytes from a serial port reach the
+// process, and in what pieces.
+//
+// - ASYNC_LOW_LATENCY (TIOCSSERIAL) asks the driver to push received bytes
+//   to the tty layer straight away instead of from a deferred work queue.
+// - USB adapters (FTDI and the like) hold bytes for up to their latency
+//   timer, 16 ms by default, before sending a partly filled USB packet. The
+//   timer is in sysfs: /sys/class/tty/ttyUSB0/device/latency_timer.
+// - The read wakeup decides when the port counts as readable. With "any"
+//   (VMIN 1, VTIME 0) every chunk wakes the reader. With "line" the port
+//   runs in canonical mode with all editing characters disabled, so each
+//   wakeup delivers exactly one complete "...\r\n" line, unchanged.
+//
+// asio reads with epoll on a non-blocking descriptor. Linux then only
+// honours VMIN when VTIME is 0, and the last bytes of a telegram shorter
+// than VMIN would wait for the next telegram, so larger VMIN values are not
+// offered; canonical mode gives line-sized wakeups without that stall.
+//
+// Everything is best effort: ptys and built-in UARTs have no latency timer,
+// ptys do not know TIOCSSERIAL. What happened is in report(). The latency
+// timer and the low latency flag are put back when the PortTuning goes away,
+// the termios settings belong to whoever opens the port next.
+
+#include <fcntl.h>
+#include <linux/serial.h>
+#include <sys/ioctl.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <initializer_list>
+#include <stdexcept>
+#include <string>
+
+namespace serial_tuning {
+
+enum class Wakeup { any, line };
+
+inline Wakeup parse_wakeup(const std::string& wakeup) {
+    if (wakeup == "any") return Wakeup::any;
+    else if (wakeup == "line") return Wakeup::line;
+    else throw std::invalid_argument("Invalid read wakeup: " + wakeup);
+}
+
+struct Settings {
+    bool low_latency = false;        // ASYNC_LOW_LATENCY and the adapter's latency timer
+    unsigned latency_timer_ms = 1;   // 1..255; only with low_latency
+    Wakeup read_wakeup = Wakeup::any;
+};
+
+// Outcome per setting, e.g. "16 -> 1 ms" or "unsupported (Inappropriate ioctl for device)"
+struct Report {
+    std::string low_latency = "unchanged";
+    std::string latency_timer = "unchanged";
+    std::string wakeup = "unchanged";
+};
+
+class PortTuning {
+public:
+    // wakeup is only applied to the port laadpaal reads from
+    PortTuning(int fd, const std::string& device, const Settings& settings, bool reading) : fd_(fd) {
+        if (settings.low_latency) {
+            set_low_latency();
+            set_latency_timer(device, settings.latency_timer_ms);
+        }
+        if (reading) set_wakeup(settings.read_wakeup);
+    }
+
+    ~PortTuning() {
+        if (!timer_path_.empty()) write_timer(timer_path_, old_timer_);
+        if (restore_flags_) {
+            serial_struct serial;
+            if (ioctl(fd_, TIOCGSERIAL, &serial) == 0) {
+                serial.flags &= ~ASYNC_LOW_LATENCY;
+                ioctl(fd_, TIOCSSERIAL, &serial);
+            }
+        }
+    }
+
+    PortTuning(const PortTuning&) = delete;
+    PortTuning& operator=(const PortTuning&) = delete;
+
+    const Report& report() const {
+        return report_;
+    }
+
+private:
+    static std::string failure(const char* what) {
+        return std::string(what) + " (" + std::strerror(errno) + ")";
+    }
+
+    static bool write_timer(const std::string& path, unsigned milliseconds) {
+        std::ofstream file(path);
+        file << milliseconds << "\n";
+        file.close();
+        return !file.fail();
+    }
+
+    void set_low_latency() {
+        serial_struct serial;
+        if (ioctl(fd_, TIOCGSERIAL, &serial) != 0) {
+            report_.low_latency = failure("unsupported");
+            return;
+        }
+        if (serial.flags & ASYNC_LOW_LATENCY) {
+            report_.low_latency = "already set";
+            return;
+        }
+        serial.flags |= ASYNC_LOW_LATENCY;
+        if (ioctl(fd_, TIOCSSERIAL, &serial) != 0) {
+            report_.low_latency = failure("failed");
+            return;
+        }
+        restore_flags_ = true;
+        report_.low_latency = "set";
+    }
+
+    // /dev/serial/by-id/... links are followed to the ttyUSB<n> node
+    void set_latency_timer(const std::string& device, unsigned milliseconds) {
+        char resolved[PATH_MAX];
+        if (!realpath(device.c_str(), resolved)) {
+            report_.latency_timer = failure("unknown device");
+            return;
+        }
+        const char* base = std::strrchr(resolved, '/');
+        std::string path = std::string("/sys/class/tty/") + (base ? base + 1 : resolved) + "/device/latency_timer";
+        std::ifstream current(path);
+        unsigned old_timer;
+        if (!(current >> old_timer)) {
+            report_.latency_timer = "unsupported (no " + path + ")";
+            return;
+        }
+        if (old_timer == milliseconds) {
+            report_.latency_timer = "already " + std::to_string(milliseconds) + " ms";
+            return;
+        }
+        if (!write_timer(path, milliseconds)) {
+            report_.latency_timer = failure(("cannot write " + path).c_str());
+            return;
+        }
+        timer_path_ = path;
+        old_timer_ = old_timer;
+        report_.latency_timer = std::to_string(old_timer) + " -> " + std::to_string(milliseconds) + " ms";
+    }
+
+    void set_wakeup(Wakeup wakeup) {
+        termios options;
+        if (tcgetattr(fd_, &options) != 0) throw std::runtime_error(failure("Cannot read terminal settings"));
+        options.c_cc[VMIN] = 1;
+        options.c_cc[VTIME] = 0;
+        if (wakeup == Wakeup::line) {
+            options.c_lflag |= ICANON;
+            options.c_lflag &= ~(ECHO | ECHONL | ISIG | IEXTEN);
+            options.c_iflag &= ~(ICRNL | INLCR | IGNCR | IXON | IXOFF);
+            for (int special : {VEOF, VEOL, VEOL2, VERASE, VWERASE, VKILL, VREPRINT, VLNEXT, VINTR, VQUIT, VSUSP}) {
+                options.c_cc[special] = _POSIX_VDISABLE;
+            }
+        } else {
+            options.c_lflag &= ~ICANON;
+        }
+        if (tcsetattr(fd_, TCSANOW, &options) != 0) throw std::runtime_error(failure("Cannot set terminal settings"));
+        report_.wakeup = wakeup == Wakeup::line ? "line" : "any";
+    }
+
+    int fd_;
+    bool restore_flags_ = false;
+    std::string timer_path_;
+    unsigned old_timer_ = 0;
+    Report report_;
+};
+
+} // namespace serial_tuning